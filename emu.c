@@ -0,0 +1,152 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Emulator contexts.  All of a context's state is in its struct emu (see
+ * xlate.h), which the translators are passed, so nothing is swapped when
+ * another is used.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include "emuterm.h"
+#include "emu.h"
+#include "input.h"
+#include "output.h"
+#include "screen.h"
+#include "uring.h"
+#include "xlate.h"
+
+
+/*
+ * Defaults for what emuterm.h declares of emuterm.c, so a program can
+ * link libemuterm.a alone.  Its own definitions take precedence.
+ */
+#define WEAK	__attribute__((weak))
+
+WEAK char *prog = "libemuterm";
+WEAK int debug = 0;
+WEAK int resize_win = 0;
+WEAK int rsize_max = RSIZE_MAX;
+
+/* only handle_output() reads, so the read size stays as it is */
+WEAK int adapt_rsize(int size, int got)
+{
+	return size;
+}
+
+
+long long mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+struct emu *emu_cur = NULL;	/* the context emuterm shows */
+
+/* a context with no terminal type: output is passed through */
+void emu_init(struct emu *e)
+{
+	int c;
+
+	memset(e, 0, sizeof *e);
+	for (c = 0; c < 4; c++)
+		e->term_arrows[c] = "";
+	e->cbp = e->cbuf;
+	e->print_lo = 1;	/* empty range */
+	e->xlate = xlate_none;
+	e->hsize = RSIZE_MIN;
+	e->savefd = -1;
+	e->icmd[0] = 'C';
+	e->icp = e->icmd+1;	/* state 1 initially, see handle_input() */
+}
+
+/* make e the context emuterm shows, writing what the last one holds */
+void emu_use(struct emu *e)
+{
+	if (e == emu_cur)
+		return;
+	if (emu_cur && emu_cur->olen)
+		(void) flush_output(emu_cur);
+	emu_cur = e;
+}
+
+/*
+ * Return a new context for terminal type term (NULL: none), and set *ws
+ * to its size as set_termtype() does.  On error, return NULL with the
+ * reason in errbuf (128 bytes).
+ */
+struct emu *emu_new(char *term, struct winsize *ws, char *errbuf)
+{
+	struct emu *e;
+	char *err;
+
+	if (!(e = malloc(sizeof *e))) {
+		strcpy(errbuf, "out of memory");
+		return NULL;
+	}
+	emu_init(e);
+	if (term && (err = set_termtype(e, term, ws, errbuf))) {
+		if (err != errbuf)
+			strcpy(errbuf, err);
+		emu_free(e);
+		return NULL;
+	}
+	return e;
+}
+
+/*
+ * Translate len bytes of output from e's terminal, and write it to sink
+ * (NULL: to the user, as emuterm does).  Return 0, or -1 if that failed.
+ */
+int emu_feed(struct emu *e, unsigned char *buf, int len,
+	     int (*sink)(char *buf, int len))
+{
+	int (*was)(char *buf, int len) = e->sink;
+	int rv;
+
+	e->sink = sink;
+	rv = (*e->xlate)(e, buf, len);
+	if (rv >= 0 && e->olen)
+		rv = flush_output(e);
+	e->sink = was;
+	return rv < 0 ? -1 : 0;
+}
+
+/* free context e, stopping its recording; if emuterm showed it, none is */
+void emu_free(struct emu *e)
+{
+	free_xlate(e);
+	free(e->hbuf);
+	free(e->scr_cur.sc_cell);
+	free(e->scr_shown.sc_cell);
+	if (e->savefd >= 0) {
+		if (ur_on)
+			ur_drain(e->savefd);
+		close(e->savefd);
+	}
+	if (e == emu_cur)
+		emu_cur = NULL;
+	free(e);
+}
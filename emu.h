@@ -0,0 +1,51 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Emulator contexts, the interface of libemuterm.
+ *
+ * A context is one emulated terminal: its terminal type, parse table,
+ * translator state, virtual screen, recording, and the ~ command being
+ * typed.  Any number of them can exist in a process, each independent of
+ * the others: emu_feed() on different contexts may run in different
+ * threads at once, but one context is fed from one thread at a time.
+ * emu_new() isn't thread-safe (the termcap library keeps the entry it
+ * read last), nor is feeding a context to the user rather than a sink.
+ *
+ * Output pacing and coalescing (-c, -l) are emuterm's, process-wide,
+ * for the context it shows; emu_feed() neither paces nor holds output.
+ *
+ * prog, debug, resize_win, rsize_max and adapt_rsize() have defaults in
+ * the library, which a program may define itself instead.
+ */
+
+#ifndef _EMU_H
+#define _EMU_H 1
+
+#include <sys/ioctl.h>		/* struct winsize */
+
+struct emu;
+
+extern struct emu *emu_cur;	/* the one emuterm shows, see emu_use() */
+
+extern struct emu *emu_new(char *term, struct winsize *ws, char *errbuf);
+extern void emu_use(struct emu *e);
+extern int emu_feed(struct emu *e, unsigned char *buf, int len,
+		    int (*sink)(char *buf, int len));
+extern void emu_free(struct emu *e);
+
+#endif /* _EMU_H */
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Benchmark the output translators: for each terminal type, generate a
+ * workload of text and control sequences from its termcap entry, check
+ * that the generic and specialized translators agree, then time both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "emuterm.h"
+#include "output.h"
+#include "screen.h"
+#include "xlate.h"
+#include "emu.h"
+
+
+#define CHUNK	4096		/* bytes per call, like a read from the pty */
+
+
+/* append s to buf, return new length */
+int add(char *buf, int len, char *s)
+{
+	int n;
+
+	if (!s || (n = strlen(s)) == 0 || n > 64)
+		return len;
+	memcpy(buf + len, s, n);
+	return len + n;
+}
+
+/* fill buf with a mix of text and the terminal's control sequences */
+int workload(struct emu *e, char *buf, int size)
+{
+	static char *names[] = { "ce", "up", "nd", "so", "se", "cd", "al",
+				 "dl", "le", "bc", "do", "ho", "us", "ue",
+				 "sr" };
+	static char *pnames[] = { "AL", "DL", "IC", "DC", "UP", "DO", "LE",
+				  "RI" };	/* take a count */
+	char *caps[sizeof names / sizeof *names];
+	char *pcaps[sizeof pnames / sizeof *pnames];
+	char *cl = get_strcap(e, "cl"), *cm = get_strcap(e, "cm");
+	char *cs = get_strcap(e, "cs");
+	int len = 0, ncaps = 0, npcaps = 0, i, n, r;
+
+	for (i = 0; i < sizeof names / sizeof *names; i++) {
+		if (caps[ncaps] = get_strcap(e, names[i]))
+			ncaps++;
+	}
+	for (i = 0; i < sizeof pnames / sizeof *pnames; i++) {
+		if (pcaps[npcaps] = get_strcap(e, pnames[i]))
+			npcaps++;
+	}
+
+	srandom(1);
+	while (len < size - 200) {
+		r = random() % 100;
+		if (r < 60) {			/* a run of text */
+			for (n = random() % 60 + 1; n > 0; n--)
+				buf[len++] = ' ' + random() % 95;
+		} else if (r < 75)
+			len = add(buf, len, "\r\n");
+		else if (r < 90)		/* cursor motion */
+			len = add(buf, len, tgoto_cm(cm, random() % e->term_lines,
+						     random() % e->term_cols));
+		else if (r < 91)
+			len = add(buf, len, cl);
+		else if (r < 92 && cs) {	/* scrolling region */
+			n = random() % e->term_lines;
+			len = add(buf, len, tgoto_cm(cs, n, n + random() %
+						     (e->term_lines - n)));
+		} else if (r < 94 && npcaps)
+			len = add(buf, len, tgoto_cm(pcaps[random() % npcaps],
+						     random() % 10 + 1, 0));
+		else if (ncaps)
+			len = add(buf, len, caps[random() % ncaps]);
+	}
+	return len;
+}
+
+/* translate all of buf, return elapsed ns */
+long long run(struct emu *e, xlate_fn *fn, char *buf, int len)
+{
+	long long t0 = mono_ns();
+	int i;
+
+	for (i = 0; i < len; i += CHUNK) {
+		if ((*fn)(e, (unsigned char *)buf + i,
+			  MIN(CHUNK, len - i)) < 0)
+			return -1;
+		if (flush_output(e) < 0)
+			return -1;
+	}
+	return mono_ns() - t0;
+}
+
+/* do the translators produce the same output? */
+int same(struct emu *e, xlate_fn *a, xlate_fn *b, char *buf, int len)
+{
+	FILE *fa = tmpfile(), *fb = tmpfile();
+	int ca, cb, rv = 1;
+
+	if (!fa || !fb)
+		return 0;
+	dup2(fileno(fa), STDOUT_FILENO);
+	run(e, a, buf, len);
+	dup2(fileno(fb), STDOUT_FILENO);
+	run(e, b, buf, len);
+	rewind(fa);
+	rewind(fb);
+	do {
+		ca = getc(fa);
+		cb = getc(fb);
+		if (ca != cb)
+			rv = 0;
+	} while (ca != EOF && cb != EOF);
+	fclose(fa);
+	fclose(fb);
+	return rv;
+}
+
+/* best MB/s over passes */
+double rate(struct emu *e, xlate_fn *fn, char *buf, int len, int passes)
+{
+	long long ns, best = -1;
+
+	while (passes-- > 0) {
+		if ((ns = run(e, fn, buf, len)) < 0)
+			return 0;
+		if (best < 0 || ns < best)
+			best = ns;
+	}
+	return best > 0 ? len * 1000.0 / best : 0;
+}
+
+
+void usage(int ec)
+{
+	fprintf(stderr, "Usage: %s [-n passes] [-s bytes] termtype...\n", prog);
+	fprintf(stderr, " -n  passes over the workload, best is reported "
+			"(default 20)\n");
+	fprintf(stderr, " -s  bytes of workload per terminal type "
+			"(default 4000000)\n");
+	fprintf(stderr, "Prints MB/s of the generic and specialized "
+			"output translators.\n");
+	exit(ec);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct winsize ws = { 24, 80 };
+	struct emu *e;
+	char errbuf[128], *buf;
+	int c, i, len, passes = 20, size = 4000000, out, null;
+	xlate_fn *base, *spec;
+	double gen, sp;
+
+	prog = strrchr(argv[0], '/');
+	prog = prog ? prog+1 : argv[0];
+
+	while ((c = getopt(argc, argv, "+:hn:s:")) != -1) {
+		switch (c) {
+		    case 'h':
+			usage(0);
+			break;
+
+		    case 'n':
+			if ((passes = atoi(optarg)) < 1) {
+				fprintf(stderr, "passes must be >= 1\n");
+				usage(1);
+			}
+			break;
+
+		    case 's':
+			if ((size = atoi(optarg)) < 1000) {
+				fprintf(stderr, "bytes must be >= 1000\n");
+				usage(1);
+			}
+			break;
+
+		    case ':':
+			fprintf(stderr, "option -%c requires an operand\n",
+				optopt);
+			usage(1);
+			break;
+
+		    case '?':
+			fprintf(stderr, "unrecognized option -%c\n", optopt);
+			usage(1);
+			break;
+		}
+	}
+	if (optind == argc)
+		usage(1);
+
+	if (!(buf = malloc(size))) {
+		perror(prog);
+		exit(1);
+	}
+	out = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	dprintf(out, "%-12s %10s %10s %8s\n", "termtype", "generic",
+		"special", "speedup");
+	for (i = optind; i < argc; i++) {
+		if (!(e = emu_new(argv[i], &ws, errbuf))) {
+			fprintf(stderr, "%s: %s: %s\n", prog, argv[i], errbuf);
+			continue;
+		}
+		/* ANSI-style terminals have only xlate_vt */
+		base = e->term_vt ? e->xlate : xlate_generic;
+		spec = e->xlate;
+		len = workload(e, buf, size);
+		if (spec != base && !same(e, base, spec, buf, len)) {
+			fprintf(stderr, "%s: %s: translators disagree\n",
+				prog, argv[i]);
+			exit(1);
+		}
+
+		dup2(null, STDOUT_FILENO);
+		gen = rate(e, base, buf, len, passes);
+		if (spec == base) {
+			dprintf(out, "%-12s %10.1f %10s %8s\n", argv[i], gen,
+				"-", "-");
+			emu_free(e);
+			continue;
+		}
+		sp = rate(e, spec, buf, len, passes);
+		dprintf(out, "%-12s %10.1f %10.1f %7.2fx\n", argv[i], gen, sp,
+			gen > 0 ? sp / gen : 0);
+		emu_free(e);
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Benchmark output pacing: run emuterm -c in a pty against a child that
+ * writes as fast as it can, and time each char as it arrives.  For each
+ * rate, report the rate achieved (the least-squares fit of arrival times),
+ * the jitter (how far chars arrive from their deadlines at exactly that
+ * rate, from the median char on), and the read and write syscalls (only
+ * those: /proc/pid/io counts no others), context switches and CPU time
+ * emuterm spent per char.
+ *
+ * With -b, time bulk output instead: bytes of text as fast as emuterm
+ * will take it, translated for -t, by each of emuterm's I/O modes.
+ *
+ * Results are CSV, a header and then one record per run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <pty.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "emuterm.h"
+
+
+#define MARK	'#'		/* what the child writes */
+#define STALL_S	10		/* give up if nothing arrives for this long */
+#define BULK_RUNS	3		/* per mode */
+
+char *emuterm = "./emuterm";
+char *term = "adm3a";
+int secs = 2;
+
+/* the output speeds of set_ospeed() */
+int rates[] = { 5, 8, 10, 13, 15, 20, 30, 60, 120, 180, 240, 480, 960,
+		1920, 3840, 5760, 11520 };
+
+
+int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(long long *)a, y = *(long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* read and write syscalls made by pid so far, -1 if unknown */
+long long syscalls(pid_t pid)
+{
+	char path[64], name[16];
+	long long n, total = 0;
+	FILE *f;
+
+	snprintf(path, sizeof path, "/proc/%d/io", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	while (fscanf(f, "%15s %lld", name, &n) == 2) {
+		if (strcmp(name, "syscr:") == 0 || strcmp(name, "syscw:") == 0)
+			total += n;
+	}
+	fclose(f);
+	return total;
+}
+
+/* pace n chars at cps through emuterm, print a record of results */
+int run(int cps, int n)
+{
+	struct winsize ws = { 24, 80 };
+	struct pollfd pfd;
+	struct rusage ru;
+	char buf[4096], cmd[128], cps_s[16];
+	long long *t, *dev, now, mid, sys;
+	int mfd, got = 0, i, k, status;
+	double mi, mt, sit, sii, rate, cpu, csw;
+	pid_t pid;
+
+	t = malloc(n * sizeof *t);
+	dev = malloc(n * sizeof *dev);
+	if (!t || !dev) {
+		perror(prog);
+		exit(1);
+	}
+	snprintf(cps_s, sizeof cps_s, "%d", cps);
+	snprintf(cmd, sizeof cmd, "head -c %d /dev/zero | tr '\\0' '%c'; "
+		 "sleep %d", n, MARK, STALL_S);
+	if ((pid = forkpty(&mfd, NULL, NULL, &ws)) < 0) {
+		perror(prog);
+		exit(1);
+	}
+	if (pid == 0) {
+		execl(emuterm, "emuterm", "-c", cps_s, "sh", "-c", cmd,
+		      (char *)NULL);
+		fprintf(stderr, "%s: %s: %s\n", prog, emuterm,
+			strerror(errno));
+		_exit(1);
+	}
+
+	/* the banner has no MARK, so count only those */
+	pfd.fd = mfd;
+	pfd.events = POLLIN;
+	while (got < n && poll(&pfd, 1, STALL_S * 1000) > 0) {
+		if ((k = read(mfd, buf, sizeof buf)) <= 0)
+			break;
+		now = mono_ns();
+		for (i = 0; i < k && got < n; i++) {
+			if (buf[i] == MARK)
+				t[got++] = now;
+		}
+	}
+	sys = syscalls(pid);
+	kill(pid, SIGTERM);
+	if (wait4(pid, &status, 0, &ru) < 0)
+		memset(&ru, 0, sizeof ru);
+	close(mfd);
+	if (got < n) {
+		fprintf(stderr, "%s: %d cps: only %d of %d chars arrived\n",
+			prog, cps, got, n);
+		free(t);
+		free(dev);
+		return -1;
+	}
+
+	/* achieved rate: least-squares slope of t[i] - t[0] over i */
+	mi = (n - 1) / 2.0;
+	for (mt = 0, i = 0; i < n; i++)
+		mt += (t[i] - t[0]) / (double)n;
+	for (sit = sii = 0, i = 0; i < n; i++) {
+		sit += (i - mi) * ((t[i] - t[0]) - mt);
+		sii += (i - mi) * (i - mi);
+	}
+	rate = sit > 0 ? sii * 1e9 / sit : 0;
+
+	/* jitter: distance from a schedule at exactly cps, through the median */
+	for (i = 0; i < n; i++)
+		dev[i] = t[i] - t[0] - i * 1000000000LL / cps;
+	qsort(dev, n, sizeof *dev, cmp_ll);
+	mid = dev[n/2];
+	for (i = 0; i < n; i++)
+		dev[i] = llabs(t[i] - t[0] - i * 1000000000LL / cps - mid);
+	qsort(dev, n, sizeof *dev, cmp_ll);
+
+	cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	      (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	csw = ru.ru_nvcsw + ru.ru_nivcsw;
+	printf("%d,%d,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,", cps, n, rate,
+	       (rate - cps) * 100.0 / cps, dev[n/2] / 1e6, dev[n*9/10] / 1e6,
+	       dev[n*99/100] / 1e6, dev[n-1] / 1e6);
+	if (sys >= 0)		/* else unknown: an empty field */
+		printf("%.3f", (double)sys / n);
+	printf(",%.3f,%.1f\n", csw / n, cpu * 1e6 / n);
+	fflush(stdout);
+	free(t);
+	free(dev);
+	return 0;
+}
+
+
+/* time n bytes of output through emuterm -t term opt, print each run */
+int bulk(char *opt, long n)
+{
+	struct winsize ws = { 24, 80 };
+	struct pollfd pfd;
+	struct rusage ru;
+	char buf[65536], cmd[128];
+	long long t0, got;
+	double cpu;
+	int mfd, run, status, k;
+	pid_t pid;
+
+	snprintf(cmd, sizeof cmd, "yes 'The quick brown fox jumps over the "
+		 "lazy dog. 0123456789' | head -c %ld", n);
+	for (run = 0; run < BULK_RUNS; run++) {
+		t0 = mono_ns();
+		if ((pid = forkpty(&mfd, NULL, NULL, &ws)) < 0) {
+			perror(prog);
+			exit(1);
+		}
+		if (pid == 0) {
+			if (*opt)
+				execl(emuterm, "emuterm", opt, "-t", term,
+				      "sh", "-c", cmd, (char *)NULL);
+			else
+				execl(emuterm, "emuterm", "-t", term,
+				      "sh", "-c", cmd, (char *)NULL);
+			fprintf(stderr, "%s: %s: %s\n", prog, emuterm,
+				strerror(errno));
+			_exit(1);
+		}
+
+		/* until emuterm exits, and the pty hangs up */
+		pfd.fd = mfd;
+		pfd.events = POLLIN;
+		for (got = 0; poll(&pfd, 1, STALL_S * 1000) > 0; got += k) {
+			if ((k = read(mfd, buf, sizeof buf)) <= 0)
+				break;
+		}
+		t0 = mono_ns() - t0;
+		kill(pid, SIGTERM);
+		if (wait4(pid, &status, 0, &ru) < 0)
+			memset(&ru, 0, sizeof ru);
+		close(mfd);
+		if (got < n) {
+			fprintf(stderr, "%s: emuterm %s: only %lld of %ld "
+				"bytes arrived\n", prog, opt, got, n);
+			return -1;
+		}
+		cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		      (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+		printf("%s,%d,%ld,%.3f,%.2f,%.1f,%.2f\n", *opt ? opt : "-",
+		       run + 1, n, t0 / 1e9, n / (t0 / 1e3), cpu * 1e11 / t0,
+		       cpu * 1e9 / n);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+
+void usage(int ec)
+{
+	fprintf(stderr, "Usage: %s [-e emuterm] [-s secs] [cps...]\n", prog);
+	fprintf(stderr, "       %s [-e emuterm] -b bytes [-t termtype]\n", prog);
+	fprintf(stderr, " -b  time bulk output instead, plain, with -P and with -u\n");
+	fprintf(stderr, " -e  emuterm to run (default %s)\n", emuterm);
+	fprintf(stderr, " -s  seconds of output per rate (default %d)\n", secs);
+	fprintf(stderr, " -t  terminal type for -b (default %s)\n", term);
+	fprintf(stderr, "Default cps: the output speeds from 5 to 11520.\n");
+	fprintf(stderr, "Prints CSV, one record per rate: chars, rate achieved "
+			"and its error (%%),\n"
+			"jitter percentiles 50, 90, 99, 100 (ms), read and "
+			"write syscalls (no\n"
+			"others), context switches and CPU usec per char.\n"
+			"With -b, one record for each of %d runs per mode: "
+			"seconds, MB/s, CPU %%\n"
+			"(of emuterm and the child), and CPU msec per MB.\n",
+			BULK_RUNS);
+	exit(ec);
+}
+
+
+int main(int argc, char **argv)
+{
+	int c, i, cps, rv = 0;
+	long bytes = 0;
+
+	prog = strrchr(argv[0], '/');
+	prog = prog ? prog+1 : argv[0];
+
+	while ((c = getopt(argc, argv, "+:b:e:hs:t:")) != -1) {
+		switch (c) {
+		    case 'b':
+			if ((bytes = atol(optarg)) < 1) {
+				fprintf(stderr, "bytes must be >= 1\n");
+				usage(1);
+			}
+			break;
+
+		    case 'e':
+			emuterm = optarg;
+			break;
+
+		    case 'h':
+			usage(0);
+			break;
+
+		    case 's':
+			if ((secs = atoi(optarg)) < 1) {
+				fprintf(stderr, "secs must be >= 1\n");
+				usage(1);
+			}
+			break;
+
+		    case 't':
+			term = optarg;
+			break;
+
+		    case ':':
+			fprintf(stderr, "option -%c requires an operand\n",
+				optopt);
+			usage(1);
+			break;
+
+		    case '?':
+			fprintf(stderr, "unrecognized option -%c\n", optopt);
+			usage(1);
+			break;
+		}
+	}
+
+	if (bytes) {
+		printf("mode,run,bytes,secs,mb_per_s,cpu_pct,cpu_ms_per_mb\n");
+		if (bulk("", bytes) < 0 || bulk("-P", bytes) < 0 ||
+		    bulk("-u", bytes) < 0)
+			rv = 1;
+		return rv;
+	}
+
+	printf("cps,chars,achieved,err_pct,p50_ms,p90_ms,p99_ms,max_ms,"
+	       "rw_syscalls_per_ch,ctxsw_per_ch,cpu_us_per_ch\n");
+	if (optind == argc) {
+		for (i = 0; i < sizeof rates / sizeof *rates; i++) {
+			if (run(rates[i], MAX(rates[i] * secs, 20)) < 0)
+				rv = 1;
+		}
+	}
+	for (i = optind; i < argc; i++) {
+		if ((cps = atoi(argv[i])) < 5) {
+			fprintf(stderr, "%s: %s: cps must be >= 5\n", prog,
+				argv[i]);
+			rv = 1;
+			continue;
+		}
+		if (run(cps, MAX(cps * secs, 20)) < 0)
+			rv = 1;
+	}
+	return rv;
+}
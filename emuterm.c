@@ -19,6 +19,7 @@
  * Emulate an old terminal by handling its output control sequences.
  */
 
+#define _GNU_SOURCE	/* for ppoll */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -32,16 +33,39 @@
 #include <termios.h>
 #include <poll.h>
 #include <pty.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include "emuterm.h"
+#include "emu.h"
 #include "input.h"
 #include "output.h"
+#include "pipeline.h"
+#include "screen.h"
+#include "trace.h"
+#include "uring.h"
+#include "xlate.h"
 
 
 char *prog;
 int debug = 0;
 int resize_win = 0;
-struct timespec odelay = {0, 0};
 int sendfd = -1;
+int rsize_max = RSIZE_MAX;
+speed_t ospeed0;		/* child's output speed when not pacing */
+int ff_cps = 0;			/* paced rate to resume after ~f */
+volatile sig_atomic_t trace_req = 0;
+
+
+/* double read size if a read filled it, halve it if mostly unused */
+int adapt_rsize(int size, int got)
+{
+	if (got >= size && size < rsize_max)
+		return MIN(2*size, rsize_max);
+	if (got < size/8 && size > RSIZE_MIN)
+		return size/2;
+	return size;
+}
 
 
 void set_ospeed(struct termios *tio, int cps)
@@ -74,8 +98,61 @@ void set_ospeed(struct termios *tio, int cps)
 		if (cps <= spdp->o_cps)
 			break;
 	}
-	cfsetospeed(tio, spdp->o_bval);
-	odelay.tv_nsec = 1000000000 / cps;
+	cfsetospeed(tio, cps ? spdp->o_bval : ospeed0);
+	set_pace(cps);
+}
+
+
+/* change the paced rate, and the child's view of it */
+void change_ospeed(int mfd, int cps)
+{
+	struct termios tio;
+
+	ff_cps = 0;
+	scr_collapse(0);
+	if (tcgetattr(mfd, &tio) == 0) {
+		set_ospeed(&tio, cps);
+		tcsetattr(mfd, TCSANOW, &tio);
+	} else
+		set_pace(cps);
+	if (cps)
+		out_msg("Output paced at %d cps\r\n", cps);
+	else
+		out_msg("Output not paced\r\n");
+}
+
+/* ~c command */
+void set_cps(int mfd, char *arg)
+{
+	int cps = 0;
+
+	if (arg[0] == ' ')	/* skip optional space after "~c" */
+		arg++;
+	if (arg[0] && (cps = atoi(arg)) < 5) {
+		out_msg("%s: cps must be >= 5\r\n", prog);
+		return;
+	}
+	change_ospeed(mfd, cps);
+}
+
+/* ~f command: toggle full speed, e.g. to skip a long listing */
+void fast_forward(int mfd)
+{
+	int cps = ff_cps;
+
+	if (cps) {
+		change_ospeed(mfd, cps);
+		return;
+	}
+	if (!ocps) {
+		out_msg("Output not paced\r\n");
+		return;
+	}
+	ff_cps = ocps;
+	out_msg("Full speed, ~f to resume %d cps\r\n",
+		ff_cps);
+	scr_collapse(1);
+	set_pace(0);		/* the child's view is unchanged */
 }
 
 
@@ -84,15 +161,30 @@ void send_file(char *path)
 	if (path[0] == ' ')	/* skip optional space after "~r" */
 		path++;
 	if (!path[0]) {
-		dprintf(STDOUT_FILENO, "%s: ~r requires a pathname\r\n", prog);
+		out_msg("%s: ~r requires a pathname\r\n", prog);
 		return;
 	}
 
 	if ((sendfd = open(path, O_RDONLY)) < 0) {
-		dprintf(STDOUT_FILENO, "%s: %s\r\n", path, strerror(errno));
+		out_msg("%s: %s\r\n", path, strerror(errno));
 		return;
 	}
-	dprintf(STDOUT_FILENO, "Sending '%s'\r\n", path);
+	out_msg("Sending '%s'\r\n", path);
+}
+
+
+/* set ts to the time until queued output or input is due, NULL if none */
+struct timespec *io_timeout(struct timespec *ts)
+{
+	long long ns = pl_on ? -1 : output_wait(), in = input_wait();
+
+	if (ns < 0 || in >= 0 && in < ns)
+		ns = in;
+	if (ns < 0)
+		return NULL;
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	return ts;
 }
 
 
@@ -104,9 +196,27 @@ void end_send(struct pollfd *pfds)
 }
 
 
+/* make the user's tty (non-)blocking; stdin and stdout may share it */
+void tty_nonblock(int on)
+{
+	int fd, flags;
+
+	for (fd = STDIN_FILENO; fd <= STDOUT_FILENO; fd++) {
+		flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK :
+					flags & ~O_NONBLOCK);
+	}
+}
+
+
 void cleanup(int sig)
 {
 	/* Stop recording, restore user terminal size, leave raw mode. */
+	pl_stop();
+	flush_output(emu_cur);
+	scr_collapse(0);
+	drain_user();
+	tty_nonblock(0);
 	dprintf(STDOUT_FILENO, "\r\n");
 	save_output(NULL);
 	omode(0);
@@ -118,40 +228,470 @@ void cleanup(int sig)
 }
 
 
-void pty_master(int mfd, pid_t cpid)
+/* SIGUSR1: dump the trace ring at the top of the loop */
+void want_trace(int sig)
+{
+	trace_req = 1;
+}
+
+
+/*
+ * Sessions (-S, -A): children on ptys of their own, or attached ttys, each
+ * with its own emulator context.  One is shown; the others' output only
+ * updates their virtual screens (see bg_output()), from which the user's
+ * screen is repainted when one is switched to (~s, ~n).  The one shown is
+ * polled at pfds[0], as a lone child is, and the others at pfds[NPFDS+i].
+ */
+#define NSESS		64
+
+struct session {
+	struct emu	*s_emu;		/* NULL once ended */
+	int		s_fd;		/* pty master, or attached tty */
+	pid_t		s_pid;		/* child, 0 if attached */
+	char		*s_term;	/* terminal type, NULL if none */
+	char		*s_name;	/* command or path */
+	int		s_exited;	/* the child has exited */
+	int		s_hup;		/* ...or at least closed the pty */
+	int		s_ended;	/* the one shown, to be freed */
+} sess[NSESS];
+int nsess = 0;			/* including those ended */
+int cur = 0;			/* the one shown */
+int switch_to = -1;		/* the one to show next */
+
+
+/*
+ * The event loop waits with epoll, but keeps its fds and their events in
+ * pfds, as for poll(): an fd is (re)registered only when its events
+ * change, and not at all while they're 0.  (epoll's event bits are
+ * poll's.)  epoll_pwait2() takes a timeout in nanoseconds, which pacing
+ * needs at high rates; without it, the timeout is rounded up to a msec.
+ */
+#define NPFDS		5	/* master, stdin, stdout, signalfd, pl_efd */
+
+int epfd = -1;
+int ep_fds[NPFDS + NSESS];	/* fd registered for each pfds[] */
+short ep_events[NPFDS + NSESS];	/* ...and its events */
+int ep_pwait2 = 1;
+
+int ep_poll(struct pollfd *pfds, int n, struct timespec *ts)
+{
+	struct epoll_event ev, evs[NPFDS + NSESS];
+	int i, k, op;
+
+	/* an fd can move to another entry, so unregister those first */
+	for (i = 0; i < n; i++) {
+		if (ep_events[i] &&
+		    (!pfds[i].events || pfds[i].fd != ep_fds[i])) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, ep_fds[i], NULL);
+			ep_events[i] = 0;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		pfds[i].revents = 0;
+		if (pfds[i].events == ep_events[i])
+			continue;
+		op = !ep_events[i] ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		ev.events = pfds[i].events;
+		ev.data.u32 = i;
+		if (epoll_ctl(epfd, op, pfds[i].fd, &ev) < 0)
+			return -1;
+		ep_fds[i] = pfds[i].fd;
+		ep_events[i] = pfds[i].events;
+	}
+
+	if (ep_pwait2) {
+		k = epoll_pwait2(epfd, evs, n, ts, NULL);
+		if (k < 0 && errno == ENOSYS)
+			ep_pwait2 = 0;
+	}
+	if (!ep_pwait2)
+		k = epoll_wait(epfd, evs, n, !ts ? -1 :
+			       ts->tv_sec*1000 + (ts->tv_nsec + 999999)/1000000);
+	for (i = 0; i < k; i++)
+		pfds[evs[i].data.u32].revents = evs[i].events;
+	return k;
+}
+
+
+/* read SIGCHLDs from signalfd sfd, and note whose children have exited */
+void reap(int sfd)
+{
+	struct signalfd_siginfo si;
+	int i;
+
+	while (read(sfd, &si, sizeof si) == sizeof si)
+		;
+	for (i = 0; i < nsess; i++) {
+		if (sess[i].s_pid && !sess[i].s_exited &&
+		    waitpid(sess[i].s_pid, NULL, WNOHANG) == sess[i].s_pid)
+			sess[i].s_exited = 1;
+	}
+}
+
+
+/* return the live session after i, or -1 if there's no other */
+int next_live(int i)
+{
+	int k;
+
+	for (k = (i+1) % nsess; k != i; k = (k+1) % nsess) {
+		if (sess[k].s_emu && !sess[k].s_ended)
+			return k;
+	}
+	return -1;
+}
+
+/* ~s command: list the sessions, or switch to session N */
+void session_cmd(char *arg)
+{
+	int i;
+
+	if (arg[0] == ' ')	/* skip optional space after "~s" */
+		arg++;
+	if (!arg[0]) {
+		for (i = 0; i < nsess; i++) {
+			if (sess[i].s_emu)
+				out_msg("%c%2d %-10s %s\r\n",
+					i == cur ? '*' : ' ', i+1,
+					sess[i].s_term ? sess[i].s_term : "-",
+					sess[i].s_name);
+		}
+		return;
+	}
+	i = atoi(arg) - 1;
+	if (i < 0 || i >= nsess || !sess[i].s_emu) {
+		out_msg("%s: no session %s\r\n", prog, arg);
+		return;
+	}
+	if (i != cur)
+		switch_to = i;
+}
+
+/* ~n command */
+void next_session(void)
+{
+	int k;
+
+	if ((k = next_live(cur)) < 0)
+		out_msg("%s: no other session\r\n", prog);
+	else
+		switch_to = k;
+}
+
+/* free session i's context and close its tty */
+void end_session(int i)
+{
+	struct session *s = &sess[i];
+
+	if (ep_events[NPFDS + i]) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s->s_fd, NULL);
+		ep_events[NPFDS + i] = 0;
+	}
+	emu_free(s->s_emu);
+	s->s_emu = NULL;
+	close(s->s_fd);
+	if (s->s_pid && !s->s_exited)
+		kill(s->s_pid, SIGTERM);
+}
+
+/*
+ * Read the background sessions' output, up to a budget each, and end
+ * those that are done.
+ */
+void bg_sessions(struct pollfd *pfds)
+{
+	struct session *s;
+	int i, n, rv, err;
+
+	for (i = 0; i < nsess; i++) {
+		s = &sess[i];
+		if (i == cur || !s->s_emu)
+			continue;
+		if (pfds[NPFDS + i].revents & POLLHUP)
+			s->s_hup = 1;
+		if (!(pfds[NPFDS + i].revents & (POLLIN|POLLERR)) &&
+		    !s->s_exited && !s->s_hup)
+			continue;
+		for (n = rv = 0; n < 4*rsize_max; n += rv) {
+			if ((rv = bg_output(s->s_emu, s->s_fd)) <= 0)
+				break;
+		}
+		err = errno;
+		if (rv > 0 || rv < 0 && err == EAGAIN &&
+			      !s->s_exited && !s->s_hup)
+			continue;
+		if (rv < 0 && err != EAGAIN && err != EIO)
+			out_msg("%s: session %d: %s\r\n", prog, i+1,
+				strerror(err));
+		else
+			out_msg("%s: session %d ended\r\n", prog, i+1);
+		end_session(i);
+	}
+}
+
+/*
+ * Show session k instead of the one shown, repainting the user's screen
+ * from its virtual screen, and free the one shown if it has ended.
+ * Return -1 if writing to the user failed.
+ */
+int show_session(struct pollfd *pfds, int k)
+{
+	struct session *s = &sess[cur];
+	int rv = 0;
+
+	/* what's still to be shown of this one only goes to its screen */
+	if (flush_output(emu_cur) < 0 || hide_output() < 0 ||
+	    scr_collapse(0) < 0)
+		rv = -1;
+	(void) flush_input(s->s_fd);
+	if (sendfd >= 0)
+		end_send(pfds);
+	if (drain_user() < 0)
+		rv = -1;
+	oterm(0);
+	if (s->s_ended)
+		end_session(cur);
+
+	cur = k;
+	s = &sess[cur];
+	emu_use(s->s_emu);
+	pfds[0].fd = s->s_fd;
+	pfds[0].events = POLLIN;
+	oterm(1);
+	if (s->s_emu->scr_on)
+		return scr_show() < 0 ? -1 : rv;
+
+	/* no virtual screen: start from a blank one */
+	if (write_user("\e[H\e[2J", 7) < 0)
+		return -1;
+	out_msg("%s: session %d's screen isn't kept\r\n", prog, cur+1);
+	return rv;
+}
+
+
+void pty_master(void)
 {
-	struct pollfd pfds[2];
+	struct pollfd pfds[NPFDS + NSESS];
+	struct timespec ts, *tp;
+	struct session *s = &sess[cur];
+	sigset_t sigs;
 	int npoll;
 	int flags;
-
+	int i, k, n, rv, budget, done;
+	int more = 0;		/* read budget ran out before the output */
+	int ssize = RSIZE_MIN;
+	int mfd = s->s_fd;
+	char *sbuf;
+
+	/*
+	 * The child's exit is read from a signalfd, so the event loop
+	 * still writes all of its output, rather than exiting at once.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+	    (pfds[3].fd = signalfd(-1, &sigs, SFD_NONBLOCK|SFD_CLOEXEC)) < 0) {
+		perror(prog);
+		return;
+	}
+	pfds[3].events = POLLIN;
 	pfds[0].fd = mfd;
 	pfds[0].events = POLLIN;
 	pfds[1].fd = STDIN_FILENO;
 	pfds[1].events = POLLIN;
-	npoll = 2;
+	pfds[2].fd = STDOUT_FILENO;
+	pfds[2].events = 0;
+	pfds[4].fd = -1;
+	pfds[4].events = 0;
+	for (i = 0; i < nsess; i++) {
+		pfds[NPFDS + i].fd = sess[i].s_fd;
+		pfds[NPFDS + i].events = 0;
+	}
+	npoll = nsess > 1 ? NPFDS + nsess : NPFDS;
 
 	/* Cleanup if we don't get some other error first. */
-	signal(SIGCHLD, cleanup);
 	signal(SIGTERM, cleanup);
-
-	/* Resize user terminal, enter raw mode, don't block on tty input. */
+	if (tring)
+		signal(SIGUSR1, want_trace);
+
+	/*
+	 * Resize user terminal, enter raw mode, don't block on the tty.
+	 * With sessions, each one's screen is followed, so it can be
+	 * repainted; the others start blank, as their children do.
+	 */
+	scr_keep = nsess > 1;
 	omode(1);
-	flags = fcntl(STDIN_FILENO, F_GETFL);
-	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+	tty_nonblock(1);
+	for (i = 0; i < nsess; i++) {
+		if (i != cur)
+			scr_start(sess[i].s_emu, 1);
+	}
 
-	dprintf(STDOUT_FILENO, "%s: escape character is ~\r\n", prog);
+	/*
+	 * With -u, use io_uring if the kernel allows, else epoll.  Its
+	 * reads start before handle_output(), so packet mode must too.
+	 */
+	if (ur_mode && nsess == 1 && ur_init(mfd, rsize_max) == 0) {
+		ur_on = 1;
+		pkt_enable(emu_cur, mfd);
+	}
+
+	/* Drain slave output until EAGAIN without blocking. */
+	for (i = 0; i < nsess; i++) {
+		flags = fcntl(sess[i].s_fd, F_GETFL);
+		fcntl(sess[i].s_fd, F_SETFL, flags | O_NONBLOCK);
+	}
+	if (!(sbuf = malloc(rsize_max))) {
+		perror(prog);
+		return;
+	}
+
+	out_msg("%s: escape character is ~\r\n", prog);
 
 	for (;;) {
 
-		if (poll(pfds, npoll, -1) < 0) {
-			dprintf(STDOUT_FILENO, "\r\npoll: %s\r\n",
+		if (trace_req) {
+			trace_req = 0;
+			(void) dump_trace(TRACE_FILE);
+		}
+
+		/* Switch sessions (~s, ~n), or from one that ended. */
+		if (switch_to >= 0) {
+			k = cur;
+			rv = show_session(pfds, switch_to);
+			switch_to = -1;
+			s = &sess[cur];
+			mfd = s->s_fd;
+			if (rv < 0) {
+				dprintf(STDOUT_FILENO, "\r\nwrite: %s\r\n",
+						       strerror(errno));
+				break;
+			}
+			if (sess[k].s_ended)
+				out_msg("%s: session %d ended\r\n", prog, k+1);
+		}
+		for (i = 0; i < nsess; i++)
+			pfds[NPFDS + i].events = i != cur && sess[i].s_emu ?
+						 POLLIN : 0;
+
+		/* Pipeline output when it can be, until it stops. */
+		if (!pl_on && !s->s_exited && !s->s_hup && nsess == 1 &&
+		    pl_ready())
+			pl_start(mfd);
+		pfds[4].fd = pl_efd;
+		pfds[4].events = pl_on ? POLLIN : 0;
+
+		/*
+		 * While paced output is queued, or too much output for the
+		 * user, leave the rest in the pty, but notice if the child's
+		 * tty discards it (packet mode).  Once the child closes the
+		 * pty, it's read below until there's no more.
+		 */
+		if (s->s_hup)
+			pfds[0].events = 0;
+		else if (pl_on)
+			pfds[0].events &= POLLOUT;
+		else if (pq_len || user_full())
+			pfds[0].events = (pfds[0].events & ~POLLIN) | POLLPRI;
+		else
+			pfds[0].events = (pfds[0].events & ~POLLPRI) | POLLIN;
+
+		/* Write what the user's tty wouldn't take, once it will. */
+		pfds[2].events = uq_len ? POLLOUT : 0;
+
+		/*
+		 * While paced input is queued, read the user's tty only if
+		 * there's room, and a file being sent only when it's empty.
+		 */
+		pfds[1].events = input_room() >= IQ_MIN ? POLLIN : 0;
+		if (sendfd >= 0 && icps && !s->s_hup)
+			pfds[0].events = iq_len ? pfds[0].events & ~POLLOUT :
+						  pfds[0].events | POLLOUT;
+
+		/*
+		 * Wake up in time to write any held output or input.  Once
+		 * the child has closed the pty, it isn't polled, so don't
+		 * wait if there's more to read.
+		 */
+		if (more && (s->s_exited || s->s_hup)) {
+			ts.tv_sec = ts.tv_nsec = 0;
+			tp = &ts;
+		} else
+			tp = io_timeout(&ts);
+		if ((ur_on ? ur_poll : ep_poll)(pfds, npoll, tp) < 0) {
+			if (errno == EINTR)
+				continue;
+			dprintf(STDOUT_FILENO, "\r\n%s: %s\r\n",
+				ur_on ? "io_uring_enter" : "epoll",
+				strerror(errno));
+			break;
+		}
+		if (pfds[3].revents & POLLIN)
+			reap(pfds[3].fd);
+		if (pfds[0].revents & POLLHUP)
+			s->s_hup = 1;
+
+		/*
+		 * The pipeline stops by itself once the child closes the pty,
+		 * but not for its exit, as others may still have the pty open.
+		 */
+		if ((pfds[4].revents & POLLIN) || s->s_exited)
+			pl_stop();
+		if (!pl_on && pl_err) {
+			dprintf(STDOUT_FILENO, "\r\nwrite: %s\r\n",
+					       strerror(pl_err));
+			break;
+		}
+		if (flush_user() < 0 || !pl_on && check_output() < 0) {
+			dprintf(STDOUT_FILENO, "\r\nwrite: %s\r\n",
 					       strerror(errno));
 			break;
 		}
+		if (check_input(mfd) < 0) {
+			dprintf(STDOUT_FILENO,
+				"\r\nWrite to child failed: %s.\r\n",
+				strerror(errno));
+			break;
+		}
+		if (nsess > 1)
+			bg_sessions(pfds);
+
+		/* Don't hold output once the user types something. */
+		if (!pl_on && (pfds[1].revents & (POLLIN|POLLERR)) &&
+		    flush_output(emu_cur) < 0)
+			break;
 
-		/* Output from slave? */
-		if (pfds[0].revents & (POLLIN|POLLERR))
-			if (handle_output(mfd) < 0) {
+		/*
+		 * Output from slave?  Read until there's no more, but
+		 * limit it so that user input is still handled.  (When
+		 * pacing, one read at a time is queued.)  Once the child
+		 * has exited or closed the pty, read without waiting until
+		 * there's no more, then quit, or show another session.
+		 */
+		done = (s->s_exited || s->s_hup) && !pq_len && !user_full();
+		more = 0;
+		if (!pl_on &&
+		    ((pfds[0].revents & (POLLIN|POLLPRI|POLLERR)) || done)) {
+			if (done && ur_on)
+				ur_unread();	/* read the rest directly */
+			budget = ocps ? 1 : 4*rsize_max;
+			for (n = rv = 0; n < budget && !user_full(); n += rv) {
+				if ((rv = handle_output(mfd)) <= 0)
+					break;
+			}
+			more = rv > 0 && !pq_len && !user_full();
+			if (rv < 0 && errno == EIO)
+				s->s_hup = 1;	/* io_uring's reads don't poll */
+			if (rv < 0 && errno == EIO ||
+			    done && (rv == 0 || rv < 0 && errno == EAGAIN)) {
+				if ((k = next_live(cur)) < 0)
+					break;
+				s->s_ended = 1;
+				switch_to = k;
+				continue;
+			}
+			if (rv < 0 && errno != EAGAIN) {
 				if (errno) {
 					dprintf(STDOUT_FILENO,
 						"\r\nhandle_output: %s\r\n",
@@ -159,6 +699,7 @@ void pty_master(int mfd, pid_t cpid)
 				}
 				break;
 			}
+		}
 
 		/* Not sending a file, handle user input normally. */
 		if (sendfd < 0) {
@@ -181,19 +722,21 @@ void pty_master(int mfd, pid_t cpid)
 
 		/* Any user input terminates file sending. */
 		if (pfds[1].revents & (POLLIN|POLLERR)) {
+			pl_stop();
 			dprintf(STDOUT_FILENO,
 				"\r\nUser terminated file send.\r\n");
+			drop_input();
 			end_send(pfds);
 			continue;
 		}
 
 		/* Slave ready for input from file? */
 		if (pfds[0].revents & POLLOUT) {
-			char buf[256];
 			int ic;
 
-			ic = read(sendfd, buf, sizeof buf);
+			ic = read(sendfd, sbuf, MIN(ssize, input_room()));
 			if (ic <= 0) {
+				pl_stop();
 				if (ic < 0)
 					dprintf(STDOUT_FILENO,
 					        "\r\nread: %s\r\n",
@@ -201,7 +744,8 @@ void pty_master(int mfd, pid_t cpid)
 				end_send(pfds);
 				continue;
 			}
-			if (write(mfd, buf, ic) < 0) {
+			ssize = adapt_rsize(ssize, ic);
+			if (queue_input(mfd, sbuf, ic) < 0) {
 				dprintf(STDOUT_FILENO,
 					"\r\nWrite to child failed: %s.\r\n",
 					strerror(errno));
@@ -210,11 +754,16 @@ void pty_master(int mfd, pid_t cpid)
 		}
 	}
 
+	free(sbuf);
+	if (s->s_exited || s->s_hup)
+		cleanup(SIGCHLD);
 	cleanup(0);
 
-	/* Ensure child is dead. */
-	signal(SIGCHLD, SIG_DFL);
-	kill(cpid, SIGTERM);
+	/* Ensure children are dead. */
+	for (i = 0; i < nsess; i++) {
+		if (sess[i].s_pid && !sess[i].s_exited)
+			kill(sess[i].s_pid, SIGTERM);
+	}
 }
 
 
@@ -230,24 +779,102 @@ void pty_slave(char **argv)
 }
 
 
+/*
+ * Start a session with terminal type term (NULL: none): a child running
+ * argv, or the tty at path.  Exit if it can't be.
+ */
+void add_session(char *term, char **argv, char *path, char *name,
+		 struct termios *tio, struct winsize *ws)
+{
+	struct session *s = &sess[nsess];
+	struct winsize w = *ws;
+	struct termios t;
+	char errbuf[128];
+	int fd;
+
+	/* Validate emulated terminal and get winsize. */
+	if (!(s->s_emu = emu_new(term, &w, errbuf))) {
+		fprintf(stderr, "%s\n", errbuf);
+		exit(1);
+	}
+	s->s_term = term;
+	s->s_name = name;
+
+	if (path) {
+		if ((fd = open(path, O_RDWR|O_NOCTTY)) < 0) {
+			perror(path);
+			exit(1);
+		}
+		if (tcgetattr(fd, &t) == 0) {
+			cfmakeraw(&t);
+			tcsetattr(fd, TCSANOW, &t);
+		}
+	} else if (!(s->s_pid = forkpty(&fd, NULL, tio, &w))) {
+		if (term) {
+			char *env = alloca(strlen(term) + 6);
+
+			sprintf(env, "TERM=%s", term);
+			putenv(env);
+		}
+		pty_slave(argv);
+	} else if (s->s_pid < 0) {
+		perror(prog);
+		exit(1);
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);	/* not for the other children */
+	s->s_fd = fd;
+	nsess++;
+}
+
+/* split "[termtype:]rest", return rest; termtype is def if not given */
+char *split_spec(char *spec, char **term, char *def)
+{
+	char *cp = strchr(spec, ':');
+
+	if (!cp || strcspn(spec, " /") < cp - spec) {
+		*term = def;
+		return spec;
+	}
+	*cp = '\0';
+	*term = spec[0] ? spec : NULL;
+	return cp+1;
+}
+
+
 void usage(int ec)
 {
-	fprintf(stderr, "Usage: %s [-c cps] [-r] [-t termtype] [cmd args...]\n",
-			prog);
-	fprintf(stderr, "Default cmd: 'bash --norc'\n");
+	fprintf(stderr, "Usage: %s [-A [termtype:]tty] [-b bytes] [-c cps] "
+			"[-C cps[,msec]] [-l usec [-m bytes]] [-p] [-P] [-r] "
+			"[-S [termtype:]cmd] [-t termtype] [-u] "
+			"[cmd args...]\n", prog);
+	fprintf(stderr, "Default cmd: 'bash --norc', unless -A or -S\n");
+	fprintf(stderr, " -A  attach a tty as another session, ~s to switch\n");
+	fprintf(stderr, " -b  max bytes per read from cmd (default %d)\n",
+			RSIZE_MAX);
 	fprintf(stderr, " -c  specify output chars/sec (default no delay)\n");
+	fprintf(stderr, " -C  specify input chars/sec, and msec more after "
+			"CR (default no delay)\n");
+	fprintf(stderr, " -l  hold output up to usec to combine writes (default 0)\n");
+	fprintf(stderr, " -m  ...or until this many bytes are held (default %d)\n",
+			OBUF_SIZE);
+	fprintf(stderr, " -p  predict the echo of keys while output is paced\n");
+	fprintf(stderr, " -P  read, translate and write output on separate threads\n");
 	fprintf(stderr, " -r  try to resize X terminal (default change scroll region)\n");
+	fprintf(stderr, " -S  run cmd with sh -c as another session (default "
+			"termtype -t's)\n");
 	fprintf(stderr, " -t  emulated terminal type (default no emulation)\n");
+	fprintf(stderr, " -u  use io_uring for I/O, if the kernel allows (not with -P)\n");
+	fprintf(stderr, "-P and -u don't apply with more than one session\n");
 	exit(ec);
 }
 
 
 void main(int argc, char **argv)
 {
-	int c;
-	int mfd;
-	pid_t pid;
-	char *term_type = NULL;
+	int c, i;
+	char *term_type = NULL, *term, *name;
+	char *specs[NSESS], kinds[NSESS];
+	int nspecs = 0;
 	int ospeed = 0;
 	struct termios tio;
 	struct winsize ws;
@@ -255,8 +882,27 @@ void main(int argc, char **argv)
 	prog = strrchr(argv[0], '/');
 	prog = prog ? prog+1 : argv[0];
 
-	while ((c = getopt(argc, argv, "+:c:dhrt:")) != -1) {
+	while ((c = getopt(argc, argv, "+:A:b:c:C:dhl:m:pPrS:t:u")) != -1) {
 		switch (c) {
+		    case 'A':
+		    case 'S':
+			if (nspecs == NSESS - 1) {
+				fprintf(stderr, "at most %d sessions\n",
+					NSESS);
+				usage(1);
+			}
+			kinds[nspecs] = c;
+			specs[nspecs++] = optarg;
+			break;
+
+		    case 'b':
+			if ((rsize_max = atoi(optarg)) < RSIZE_MIN) {
+				fprintf(stderr, "bytes must be >= %d\n",
+					RSIZE_MIN);
+				usage(1);
+			}
+			break;
+
 		    case 'c':
 			if ((ospeed = atoi(optarg)) < 5) {
 				fprintf(stderr, "cps must be >= 5\n");
@@ -264,6 +910,14 @@ void main(int argc, char **argv)
 			}
 			break;
 
+		    case 'C':
+			if (set_ipace(-1, optarg) < 0) {
+				fprintf(stderr, "cps must be >= 5, "
+					"msec >= 0\n");
+				usage(1);
+			}
+			break;
+
 		    case 'd':
 			debug++;
 			break;
@@ -272,6 +926,30 @@ void main(int argc, char **argv)
 			usage(0);
 			break;
 
+		    case 'l':
+			if ((coalesce_us = atol(optarg)) < 0) {
+				fprintf(stderr, "usec must be >= 0\n");
+				usage(1);
+			}
+			break;
+
+		    case 'm':
+			coalesce_max = atoi(optarg);
+			if (coalesce_max < 1 || coalesce_max > OBUF_SIZE) {
+				fprintf(stderr, "bytes must be 1 to %d\n",
+					OBUF_SIZE);
+				usage(1);
+			}
+			break;
+
+		    case 'p':
+			predict_echo = 1;
+			break;
+
+		    case 'P':
+			pl_mode = 1;
+			break;
+
 		    case 'r':
 			resize_win = 1;
 			break;
@@ -280,6 +958,10 @@ void main(int argc, char **argv)
 			term_type = optarg;
 			break;
 
+		    case 'u':
+			ur_mode = 1;
+			break;
+
 		    case ':':
 			fprintf(stderr, "option -%c requires an operand\n",
 				optopt);
@@ -297,33 +979,23 @@ void main(int argc, char **argv)
 	tcgetattr(STDIN_FILENO, &tio);
 	ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
 
-	/* Validate emulated terminal and get winsize. */
-	if (term_type) {
-		char errbuf[128], *err;
-
-		memset(&ws, sizeof ws, 0);
-		if (err = set_termtype(term_type, &ws, errbuf)) {
-			fprintf(stderr, "%s\n", err);
-			exit(1);
-		}
-	}
-
+	ospeed0 = cfgetospeed(&tio);
 	if (ospeed)
 		set_ospeed(&tio, ospeed);
-	if (pid = forkpty(&mfd, NULL, &tio, &ws)) {
-		if (pid < 0) {
-			perror(prog);
-			exit(1);
-		}
-		pty_master(mfd, pid);
-	} else {
-		if (term_type) {
-			char *term = alloca(strlen(term_type) + 6);
 
-			sprintf(term, "TERM=%s", term_type);
-			putenv(term);
-		}
-		pty_slave(argv+optind);
+	/* cmd is the first session, unless there are only -A and -S ones */
+	if (optind < argc || !nspecs)
+		add_session(term_type, argv+optind, NULL,
+			    optind < argc ? argv[optind] : "bash", &tio, &ws);
+	for (i = 0; i < nspecs; i++) {
+		char *sh[] = {"sh", "-c", NULL, NULL};
+
+		name = split_spec(specs[i], &term, term_type);
+		sh[2] = name;
+		add_session(term, sh, kinds[i] == 'A' ? name : NULL, name,
+			    &tio, &ws);
 	}
+	emu_use(sess[cur].s_emu);
+	pty_master();
 	exit(0);
 }
@@ -23,10 +23,20 @@
 #define _EMUTERM_H 1
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+#define RSIZE_MIN	128		/* initial bytes per read */
+#define RSIZE_MAX	65536		/* default -b */
 
 extern char *prog;
-extern int debug, resize_win;
-extern struct timespec odelay;
+extern int debug, resize_win, rsize_max;
 extern void send_file(char *path);
+extern void set_cps(int mfd, char *arg);
+extern void fast_forward(int mfd);
+extern void session_cmd(char *arg);
+extern void next_session(void);
+extern void tty_nonblock(int on);
+extern int adapt_rsize(int size, int got);
+extern long long mono_ns(void);
 
 #endif /* _EMUTERM_H */
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Decode a trace written by emuterm -ddd (see ~t and SIGUSR1).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include "emuterm.h"
+#include "output.h"
+#include "screen.h"
+#include "trace.h"
+#include "xlate.h"
+
+
+char *prog;
+
+static char *anames[] = {
+	[AC_IGNORE] = "IGN", [AC_NEXT] = "NXT", [AC_PRINT] = "PRT",
+	[AC_FMT] = "FMT", [AC_FMT1] = "FM1", [AC_FMT2] = "FM2",
+	[AC_FMT2_REV] = "F2R", [AC_LL] = "LL", [AC_STLINE] = "STL",
+	[AC_REGION] = "REG",
+};
+
+
+void usage(int ec)
+{
+	fprintf(stderr, "Usage: %s [file]\n", prog);
+	fprintf(stderr, "Default file: '%s'\n", TRACE_FILE);
+	fprintf(stderr, "Prints time, byte, capability, action, and "
+			"arguments of each record.\n");
+	exit(ec);
+}
+
+
+int main(int argc, char **argv)
+{
+	char magic[sizeof TRACE_MAGIC - 1], ch[8], *path = TRACE_FILE;
+	struct trace tr;
+	long long t0 = -1;
+	unsigned long n = 0;
+	FILE *f;
+
+	prog = strrchr(argv[0], '/');
+	prog = prog ? prog+1 : argv[0];
+
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+		usage(argc == 2 && strcmp(argv[1], "-h") == 0 ? 0 : 1);
+	if (argc == 2)
+		path = argv[1];
+
+	if (!(f = fopen(path, "r"))) {
+		fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+		exit(1);
+	}
+	if (fread(magic, sizeof magic, 1, f) != 1 ||
+	    memcmp(magic, TRACE_MAGIC, sizeof magic) != 0) {
+		fprintf(stderr, "%s: %s: not an emuterm trace\n", prog, path);
+		exit(1);
+	}
+
+	while (fread(&tr, sizeof tr, 1, f) == 1) {
+		if (t0 < 0)
+			t0 = tr.tr_ns;
+		if (tr.tr_c >= ' ' && tr.tr_c < 0177)
+			snprintf(ch, sizeof ch, "'%c'", tr.tr_c);
+		else
+			snprintf(ch, sizeof ch, "\\%03o", tr.tr_c);
+		printf("%10.6f %-5s %.2s %-3s", (tr.tr_ns - t0) / 1e9, ch,
+		       tr.tr_cap[0] ? tr.tr_cap : "--",
+		       tr.tr_action < sizeof anames / sizeof *anames ?
+		       anames[tr.tr_action] : "???");
+		switch (tr.tr_action) {
+		    case AC_FMT1:
+			printf(" %u", tr.tr_arg[0]);
+			break;
+
+		    case AC_FMT2:
+		    case AC_FMT2_REV:
+		    case AC_REGION:
+			printf(" %u %u", tr.tr_arg[0], tr.tr_arg[1]);
+			break;
+		}
+		printf("\n");
+		n++;
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+		exit(1);
+	}
+	fclose(f);
+	fprintf(stderr, "%lu records\n", n);
+	return 0;
+}
@@ -21,25 +21,175 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <termio.h>
-#define __USE_GNU /* for sighandler_t */
 #include <signal.h>
 #include "emuterm.h"
+#include "emu.h"
 #include "input.h"
 #include "output.h"
+#include "pipeline.h"
+#include "screen.h"
+#include "xlate.h"
+
+
+/*
+ * With -C, input to the child is paced to icps chars per second, the way
+ * output is (see pace_wait), plus icr_ns after each CR, so a paste
+ * doesn't overrun a program that expects a typist.  Input is queued at
+ * iq, and released by check_input() as it comes due.  "~" commands are
+ * still handled as they're read, ahead of the queue.  The user's tty is
+ * only read while the queue has room for what one read can produce; a
+ * file sent with ~r is queued a read at a time.
+ */
+int icps = 0;
+long long icr_ns = 0;
+long long ipace_t0 = 0, ipace_n = 0;
+char iq[IQ_SIZE];
+int iq_off = 0, iq_len = 0;
+
+/* write n bytes to the child, or queue them if pacing */
+int queue_input(int mfd, char *buf, int n)
+{
+	if (!icps)
+		return write_all(mfd, buf, n);
+	if (!iq_len) {		/* don't let an idle spell become a burst */
+		ipace_t0 = mono_ns();
+		ipace_n = 0;
+	}
+	if (iq_off + iq_len + n > IQ_SIZE) {
+		memmove(iq, iq + iq_off, iq_len);
+		iq_off = 0;
+	}
+	n = MIN(n, IQ_SIZE - iq_len);	/* can't happen, see input_room */
+	memcpy(iq + iq_off + iq_len, buf, n);
+	iq_len += n;
+	return 0;
+}
+
+/* return bytes that can be queued */
+int input_room(void)
+{
+	return icps ? IQ_SIZE - iq_len : IQ_SIZE;
+}
+
+/* discard queued input */
+void drop_input(void)
+{
+	iq_off = iq_len = 0;
+}
+
+/* write all the queued input now */
+int flush_input(int mfd)
+{
+	int rv;
+
+	if (!iq_len)
+		return 0;
+	rv = write_all(mfd, iq + iq_off, iq_len);
+	drop_input();
+	return rv;
+}
+
+/* return nanoseconds until queued input is due, or -1 if none queued */
+long long input_wait(void)
+{
+	return iq_len ? pace_wait(&ipace_t0, &ipace_n, icps) : -1;
+}
+
+/* write the queued input that's due, up to and including a CR */
+int check_input(int mfd)
+{
+	char *cr;
+	int n;
+
+	if (!iq_len || input_wait() > 0)
+		return 0;
+	n = (mono_ns() - ipace_t0) * icps / 1000000000 - ipace_n;
+	n = MAX(1, MIN(n, iq_len));
+	if (icr_ns && (cr = memchr(iq + iq_off, '\r', n))) {
+		n = cr - (iq + iq_off) + 1;
+		ipace_t0 += icr_ns;
+	}
+	ipace_n += n;
+	iq_off += n;
+	iq_len -= n;
+	return write_all(mfd, iq + iq_off - n, n);
+}
+
+/* pace input from "cps[,msec]", or not if arg is empty; -1 if invalid */
+int set_ipace(int mfd, char *arg)
+{
+	long cps = 0, ms = 0;
+	char *ep;
+	int rv = 0;
+
+	if (arg[0]) {
+		cps = strtol(arg, &ep, 10);
+		if (*ep == ',')
+			ms = strtol(ep+1, &ep, 10);
+		if (*ep || cps < 5 || ms < 0)
+			return -1;
+	}
+	if (!cps)
+		rv = flush_input(mfd);
+	icps = cps;
+	icr_ns = ms * 1000000;
+	ipace_t0 = mono_ns();
+	ipace_n = 0;
+	return rv;
+}
+
+/* ~C command */
+void set_icps(int mfd, char *arg)
+{
+	if (arg[0] == ' ')	/* skip optional space after "~C" */
+		arg++;
+	if (set_ipace(mfd, arg) < 0)
+		out_msg("%s: ~C cps[,msec], cps must be "
+			">= 5\r\n", prog);
+	else if (!icps)
+		out_msg("Input not paced\r\n");
+	else if (icr_ns)
+		out_msg("Input paced at %d cps, %lld ms "
+			"after CR\r\n", icps, icr_ns / 1000000);
+	else
+		out_msg("Input paced at %d cps\r\n", icps);
+}
+
+/* ~p command */
+void toggle_predict(void)
+{
+	predict_echo = !predict_echo;
+	if (!predict_echo) {
+		scr_unpredict();
+		out_msg("Predictive echo off\r\n");
+	} else if (!emu_cur->scr_on)
+		out_msg("Predictive echo on, once output is "
+			"paced (-t and ~c)\r\n");
+	else
+		out_msg("Predictive echo on\r\n");
+}
+
+/* predict the echo of c, which follows ahead bytes not yet queued */
+void predict(int c, int ahead)
+{
+	if (predict_echo)
+		scr_predict(c, icps ? (iq_len + ahead) * 1000000000LL / icps :
+				      0);
+}
 
 
 /* read input from user, write to slave pty */
 int handle_input(int mfd)
 {
+	struct emu *e = emu_cur;
 	int ic, nc, rv = 0;
 	char buf[128], *bp;	/* user input */
 	char obuf[512], *op;	/* output to user */
-	char wbuf[256], *wp;	/* write to slave */
-	sighandler_t osig;
-	static char cmd[512] = "C", *cp = cmd+1; /* state 1 initially */
+	char wbuf[IQ_MIN], *wp;	/* write to slave */
 
 	if ((ic = read(STDIN_FILENO, buf, sizeof buf)) <= 0)
 		return ic;
@@ -59,45 +209,49 @@ int handle_input(int mfd)
 	for ( ; bp < buf + ic; bp++) {
 		char cc, c = *bp;
 
-		if (cp < cmd+2 &&	    /* not yet in state 2 */
-		    term_set &&		    /* emulating */
+		if (e->icp < e->icmd+2 &&   /* not yet in state 2 */
+		    e->term_set &&	    /* emulating */
 		    c == '\033' &&	    /* starts with ESC */
 		    bp + 2 < buf + ic &&    /* potential xterm key sequence */
 		    (bp[1] == '[' || bp[1] == 'O')) {
 			switch (cc = bp[2]) {
 			    case 'A': case 'B': case 'C': case 'D':
-				nc = strlen(term_arrows[cc - 'A']);
-				memcpy(wp, term_arrows[cc - 'A'], nc);
+				predict(c, wp - wbuf);
+				nc = strlen(e->term_arrows[cc - 'A']);
+				memcpy(wp, e->term_arrows[cc - 'A'], nc);
 				wp += nc;
 				bp += 2;
-				cp = cmd;   /* reset to state 0 */
+				e->icp = e->icmd;	/* reset to state 0 */
 				continue;
 			}
 		}
 
 		/* State 0: check for newline */
-		if (cp == cmd) {
+		if (e->icp == e->icmd) {
 			if (c == '\r' || c == '\n')
-				cp++;	    /* advance to state 1 */
+				e->icp++;	/* advance to state 1 */
+			predict(c, wp - wbuf);
 			*wp++ = c;
 			continue;
 		}
 
 		/* State 1: check for "~" */
-		if (cp == cmd+1) {
+		if (e->icp == e->icmd+1) {
 			if (c == '~') {
-				*cp++ = c;  /* advance to state 2 */
+				*e->icp++ = c;	/* advance to state 2 */
 				*op++ = c;
 			} else {
-				cp = cmd;   /* reset to state 0 */
+				e->icp = e->icmd;	/* reset to state 0 */
+				predict(c, wp - wbuf);
 				*wp++ = c;
 			}
 			continue;
 		}
 
 		/* State 2: check for "~~" */
-		if (cp == cmd+2 && c == '~') {
-			cp = cmd;	    /* reset to state 0 */
+		if (e->icp == e->icmd+2 && c == '~') {
+			e->icp = e->icmd;	/* reset to state 0 */
+			predict(c, wp - wbuf);
 			*wp++ = c;
 			continue;
 		}
@@ -105,12 +259,12 @@ int handle_input(int mfd)
 		/* State 2+: perform rudimentary line editing. */
 		switch (c) {
 		    case '\025': case '\030':	/* ^U, ^X: erase line */
-			while (cp > cmd+1) {
+			while (e->icp > e->icmd+1) {
 				*op++ = '\b';
 				*op++ = ' ';
 				*op++ = '\b';
-				cp--;
-				if (*cp < ' ') {
+				e->icp--;
+				if (*e->icp < ' ') {
 					*op++ = '\b';
 					*op++ = ' ';
 					*op++ = '\b';
@@ -123,8 +277,8 @@ int handle_input(int mfd)
 			*op++ = '\b';
 			*op++ = ' ';
 			*op++ = '\b';
-			cp--;
-			if (*cp < ' ') {
+			e->icp--;
+			if (*e->icp < ' ') {
 				*op++ = '\b';
 				*op++ = ' ';
 				*op++ = '\b';
@@ -134,7 +288,7 @@ int handle_input(int mfd)
 		    case '\r': case '\n':	/* newline */
 			*op++ = '\r';
 			*op++ = '\n';
-			*cp = '\0';
+			*e->icp = '\0';
 			break;
 
 		    default:
@@ -143,68 +297,113 @@ int handle_input(int mfd)
 				*op++ = c + '@';
 			} else
 				*op++ = c;
-			*cp++ = c;
+			*e->icp++ = c;
 			continue;
 		}
 
-		/* Flush buffers. */
+		/*
+		 * Flush buffers.  Commands write to the user, and may change
+		 * how output is handled, so stop any pipelined output.
+		 */
+		pl_stop();
 		if (wp - wbuf) {
-			if (write(mfd, wbuf, wp-wbuf) < 0)
+			if (queue_input(mfd, wbuf, wp-wbuf) < 0)
 				rv = -1;
 		}
 		if (op - obuf)
-			write(STDOUT_FILENO, obuf, op-obuf);
+			out_msg("%.*s", (int)(op-obuf), obuf);
 		wp = wbuf;
 		op = obuf;
-		cp = cmd+1;	/* back to state 1 after handling command */
+		e->icp = e->icmd+1;	/* state 1 after handling command */
 
 		/* Handle command. */
-		switch (c = cmd[2]) {
+		switch (c = e->icmd[2]) {
 		    case '?': case 'h':
-			dprintf(STDOUT_FILENO, "~~      send ~\r\n"
-					       "~?      help\r\n"
-					       "~.      quit\r\n"
-					       "~^Z     suspend\r\n"
-					       "~r FILE send file\r\n"
-					       "~w FILE record raw output\r\n"
-					       "~w      stop recording\r\n");
+			out_msg("~~      send ~\r\n"
+			       "~?      help\r\n"
+			       "~.      quit\r\n"
+			       "~^Z     suspend\r\n"
+			       "~c CPS  pace output (no CPS: "
+					       "don't)\r\n"
+			       "~C CPS[,MS] pace input, MS more "
+					       "after CR\r\n"
+			       "~f      full speed on/off\r\n"
+			       "~n      next session\r\n"
+			       "~p      predictive echo on/off\r\n"
+			       "~r FILE send file\r\n"
+			       "~s      list sessions\r\n"
+			       "~s N    switch to session N\r\n"
+			       "~t FILE save trace (-ddd)\r\n"
+			       "~w FILE record raw output\r\n"
+			       "~w      stop recording\r\n");
 			break;
 
 		    case '.': case 'q':
 			save_output(NULL);
-			dprintf(STDOUT_FILENO, "%s: exiting\r\n", prog);
+			out_msg("%s: exiting\r\n", prog);
 			return -2;
 			break;
 
 		    case '\032':	/* ^Z */
+			drain_user();
+			tty_nonblock(0);
 			omode(0);
-			osig = signal(SIGCHLD, SIG_IGN);
 			kill(0, SIGTSTP);
-			signal(SIGCHLD, osig);
 			omode(1);
+			tty_nonblock(1);
+			break;
+
+		    case 'c':
+			set_cps(mfd, e->icmd+3);
+			break;
+
+		    case 'C':
+			set_icps(mfd, e->icmd+3);
+			break;
+
+		    case 'f':
+			fast_forward(mfd);
+			break;
+
+		    case 'n':
+			next_session();
+			break;
+
+		    case 'p':
+			toggle_predict();
 			break;
 
 		    case 'r':
-			send_file(cmd+3);
+			send_file(e->icmd+3);
+			break;
+
+		    case 's':
+			session_cmd(e->icmd+3);
+			break;
+
+		    case 't':
+			save_trace(e->icmd+3);
 			break;
 
 		    case 'w':
-			save_output(cmd+3);
+			save_output(e->icmd+3);
 			break;
 
 		    default:
-			dprintf(STDOUT_FILENO, "%s: unrecognized command %s, "
-				"~? for help\r\n", prog, cp);
+			out_msg("%s: unrecognized command %s, "
+				"~? for help\r\n", prog, e->icp);
 			break;
 		}
 	}
 
 	/* Flush buffers. */
 	if (wp - wbuf) {
-		if (write(mfd, wbuf, wp-wbuf) < 0)
+		if (queue_input(mfd, wbuf, wp-wbuf) < 0)
 			rv = -1;
 	}
-	if (op - obuf)
-		write(STDOUT_FILENO, obuf, op-obuf);
+	if (op - obuf) {
+		pl_stop();
+		out_msg("%.*s", (int)(op-obuf), obuf);
+	}
 	return rv;
 }
@@ -22,6 +22,18 @@
 #ifndef _INPUT_H
 #define _INPUT_H 1
 
+#define IQ_SIZE		65536		/* paced input queue */
+#define IQ_MIN		256		/* most queued by one handle_input */
+
+extern int icps, iq_len;
+
 extern int handle_input(int mfd);
+extern int queue_input(int mfd, char *buf, int n);
+extern int input_room(void);
+extern void drop_input(void);
+extern int flush_input(int mfd);
+extern long long input_wait(void);
+extern int check_input(int mfd);
+extern int set_ipace(int mfd, char *arg);
 
 #endif /* _INPUT_H */
@@ -0,0 +1,545 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Generate specialized output translators for the given terminal types.
+ *
+ * Each terminal's frozen parse table becomes a C function: a switch on
+ * the parse state, then on the character, with each control sequence's
+ * replacement written inline.  Argument parsing steps get states of
+ * their own.  The result is compiled into emuterm, and set_termtype()
+ * uses it whenever the terminal's parse table has the same pt_sig().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "emuterm.h"
+#include "output.h"
+#include "screen.h"
+#include "xlate.h"
+#include "emu.h"
+
+
+/* none yet, that's what we're making */
+struct xlate xlates[] = { { NULL } };
+
+struct emu *tt;		/* the terminal type being generated */
+
+int *nump;		/* # of args parsed before each state */
+int *label;		/* first step state of each entry with steps */
+int need_v, need_p, need_again;
+int need_twice;		/* a char can end one sequence and start another */
+FILE *out;		/* generated switch statement */
+int depth;		/* its current indentation */
+
+
+/* # of states needed for a step */
+int nsub(enum state s)
+{
+	return s >= ST_GET_3D ? ST_GET_1D - s + 1 : 1;
+}
+
+/* translator function name for a terminal type */
+char *func_name(char *term)
+{
+	static char fn[64];
+	char *t = fn + sprintf(fn, "xl_");
+
+	for ( ; *term && t < fn + sizeof fn - 1; term++)
+		*t++ = (*term >= 'a' && *term <= 'z') ||
+		       (*term >= 'A' && *term <= 'Z') ||
+		       (*term >= '0' && *term <= '9') ? *term : '_';
+	*t = '\0';
+	return fn;
+}
+
+void fail(char *msg, struct pentry *pp)
+{
+	fprintf(stderr, "%s: %s [%2.2s]\n", prog, msg, pp->pt_cap);
+	exit(1);
+}
+
+/* print a line of generated code, indented; labels are outdented */
+void put(char *fmt, ...)
+{
+	char line[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof line, fmt, ap);
+	va_end(ap);
+	if (strncmp(line, "case ", 5) == 0 || strncmp(line, "default:", 8) == 0)
+		fprintf(out, "%.*s    %s\n", depth-1, "\t\t\t\t\t\t\t\t", line);
+	else
+		fprintf(out, "%.*s%s\n", depth, "\t\t\t\t\t\t\t\t", line);
+}
+
+/* char c as a C character constant */
+char *char_const(int c)
+{
+	static char buf[8];
+
+	if (c == '\'' || c == '\\')
+		sprintf(buf, "'\\%c'", c);
+	else if (c >= 32 && c < 127)
+		sprintf(buf, "'%c'", c);
+	else
+		sprintf(buf, "0%03o", c);
+	return buf;
+}
+
+/* append literal s of length n to output */
+void put_lit(char *s, int n)
+{
+	char buf[256], *b = buf;
+	unsigned char c;
+	int i;
+
+	if (n == 0)
+		return;
+	if (n == 1) {
+		put("*d++ = %s;", char_const((unsigned char)*s));
+		return;
+	}
+	for (i = 0; i < n && b < buf + sizeof buf - 5; i++) {
+		if ((c = s[i]) == '"' || c == '\\' || c == '?')
+			b += sprintf(b, "\\%c", c);
+		else if (c >= 32 && c < 127)
+			*b++ = c;
+		else
+			b += sprintf(b, "\\%03o", c);
+	}
+	*b = '\0';
+	put("memcpy(d, \"%s\", %d);", buf, n);
+	put("d += %d;", n);
+}
+
+/* append emitter output with args a0, a1 */
+void put_emit(struct emit *em, char *a0, char *a1)
+{
+	put_lit(em->em_frag[0], em->em_len[0]);
+	if (em->em_nargs > 0) {
+		put("d = put_dec(d, %s);", a0);
+		put_lit(em->em_frag[1], em->em_len[1]);
+	}
+	if (em->em_nargs > 1) {
+		put("d = put_dec(d, %s);", a1);
+		put_lit(em->em_frag[2], em->em_len[2]);
+	}
+}
+
+/* write the output of entry pp's action, after k args */
+void put_output(struct pentry *pp, int k)
+{
+	char row[64], col[64];
+	int rev;
+
+	switch (pp->pt_action) {
+	    case AC_IGNORE:
+	    case AC_NEXT:
+		break;
+
+	    case AC_PRINT:
+		put("*d++ = c;");
+		break;
+
+	    case AC_FMT:
+	    case AC_STLINE:
+		put_emit(pp->pt_emit, NULL, NULL);
+		break;
+
+	    case AC_FMT1:
+		if (k != 1)
+			fail("fmt1 needs 1 argument", pp);
+		put_emit(pp->pt_emit, "p[0]", NULL);
+		break;
+
+	    case AC_FMT2_REV:
+	    case AC_FMT2:
+		if (k != 2)
+			fail("fmt2 needs 2 arguments", pp);
+		rev = pp->pt_action == AC_FMT2_REV;
+
+		/*
+		 * Hazeltine row/col. can be specified multiple ways.  Ensure
+		 * in range; termcap row, col are 0-based, ANSI is 1-based.
+		 */
+		sprintf(row, tt->term_hz
+			? "MIN(p[%d] %% 32, e->term_lines-1) + 1"
+			: "MIN(p[%d], e->term_lines-1) + 1", rev);
+		sprintf(col, tt->term_hz
+			? "MIN(p[%d] %% 96, e->term_cols-1) + 1"
+			: "MIN(p[%d], e->term_cols-1) + 1", !rev);
+		put_emit(pp->pt_emit, row, col);
+		break;
+
+	    case AC_LL:
+		put_emit(pp->pt_emit, "e->term_lines", NULL);
+		break;
+
+	    case AC_REGION:
+		if (k != 2)
+			fail("region needs 2 arguments", pp);
+		put_emit(pp->pt_emit, "MIN(p[0], e->term_lines-1) + 1",
+			 "MIN(p[1], e->term_lines-1) + 1");
+		break;
+	}
+}
+
+/* do the action for entry pp, after k args; at_root if still in state 0 */
+void put_action(struct pentry *pp, int k, int at_root)
+{
+	if (pp->pt_action == AC_NEXT) {
+		put("pos = %d;", pp->pt_next);
+		put("continue;");
+		return;
+	}
+	put_output(pp, k);
+	if (!at_root)
+		put("pos = 0;");
+	put("continue;");
+}
+
+/* start step j of entry e, which is arg k */
+void put_start(int e, int j, int k)
+{
+	struct pentry *pp = tt->pentries + e;
+	int lab = label[e], i;
+
+	if (k >= 2)
+		fail("too many arguments", pp);
+	for (i = 0; i < j; i++)
+		lab += nsub(pp->pt_steps[i].pt_initial);
+	put("pos = %d;", lab);
+	if (pp->pt_steps[j].pt_initial != ST_GET_1C)
+		put("p[%d] = 0;", k);
+	put("continue;");
+}
+
+/* generate the states for the steps of entry e, reached after k args */
+void put_steps(int e, int k)
+{
+	struct pentry *pp = tt->pentries + e;
+	int lab = label[e], j, inc;
+	enum state s;
+
+	need_p = 1;
+	for (j = 0; j < pp->pt_nsteps; j++, k++) {
+		s = pp->pt_steps[j].pt_initial;
+		inc = pp->pt_steps[j].pt_inc;
+		switch (s) {
+		    case ST_GET_1C:
+			put("case %d:\t\t/* %2.2s 1c */", lab++, pp->pt_cap);
+			put("p[%d] = c;", k);
+			break;
+
+		    case ST_GET_DIGITS:
+			need_v = 1;
+			put("case %d:\t\t/* %2.2s dd */", lab++, pp->pt_cap);
+			put("if ((v = c - '0') >= 0 && v <= 9) {");
+			depth++;
+			put("p[%d] = p[%d]*10 + v;", k, k);
+			put("continue;");
+			depth--;
+			put("}");
+			break;
+
+		    case ST_GET_3D:
+		    case ST_GET_2D:
+		    case ST_GET_1D:
+			need_v = 1;
+			for ( ; s <= ST_GET_1D; s++) {
+				put("case %d:\t\t/* %2.2s %.2s */", lab++, pp->pt_cap,
+				    "--nx1cdd3d2d1d" + 2*s);
+				put("if ((v = c - '0') < 0 || v > 9)");
+				put("\tv = 0;");
+				put("p[%d] = p[%d]*10 + v;", k, k);
+				if (s < ST_GET_1D) {
+					put("pos = %d;", lab);
+					put("continue;");
+				}
+			}
+			s = ST_GET_1D;
+			break;
+
+		    default:
+			fail("bad step", pp);
+		}
+
+		if (inc) {
+			put("if ((p[%d] -= %d) < 0)", k, inc);
+			put("\tp[%d] = 0;", k);
+		} else if (s == ST_GET_DIGITS) {	/* in case of overflow */
+			put("if (p[%d] < 0)", k);
+			put("\tp[%d] = 0;", k);
+		}
+
+		/* if more steps, start it */
+		if (j+1 < pp->pt_nsteps) {
+			put_start(e, j+1, k+1);
+			continue;
+		}
+
+		/*
+		 * The non-digit that ends %d starts the next state, or
+		 * if %d ends the sequence, the next sequence.
+		 */
+		if (s == ST_GET_DIGITS) {
+			need_again = 1;
+			if (pp->pt_action != AC_NEXT) {
+				need_twice = 1;
+				put_output(pp, k+1);
+				put("pos = 0;");
+			} else
+				put("pos = %d;", pp->pt_next);
+			put("goto again;");
+		} else
+			put_action(pp, k+1, 0);
+	}
+}
+
+/* would entries a and b generate the same code? */
+int same_code(struct pentry *a, struct pentry *b)
+{
+	if (a->pt_action != b->pt_action || a->pt_nsteps || b->pt_nsteps)
+		return 0;
+	if (a->pt_action == AC_NEXT)
+		return a->pt_next == b->pt_next;
+	return a->pt_action <= AC_PRINT || a->pt_emit == b->pt_emit;
+}
+
+/* generate the case for state st */
+void put_state(int st)
+{
+	struct pstate *ps = tt->pstates + st;
+	struct pentry *pp, *bp;
+	char line[128], *l, caps[64], *cp;
+	int done[128], k, k2, c, n, best, most;
+
+	/* group entries that do the same thing, the largest is the default */
+	for (k = 0; k < ps->ps_nent; k++)
+		done[k] = -1;
+	for (k = best = most = 0; k < ps->ps_nent; k++) {
+		if (done[k] >= 0)
+			continue;
+		for (k2 = k; k2 < ps->ps_nent; k2++) {
+			if (k2 == k || same_code(tt->pentries + ps->ps_base + k,
+						 tt->pentries + ps->ps_base + k2))
+				done[k2] = k;
+		}
+		for (c = n = 0; c < 128; c++)
+			n += done[ps->ps_class[c]] == k;
+		if (n > most) {
+			most = n;
+			best = k;
+		}
+	}
+
+	put("case %d:", st);
+	put("switch (c) {");
+	depth++;
+	for (n = 0; n <= ps->ps_nent; n++) {
+		/* do the default last */
+		if ((k = n < ps->ps_nent ? n : best) == best && n < ps->ps_nent)
+			continue;
+		if (done[k] != k)
+			continue;
+		pp = tt->pentries + ps->ps_base + k;
+
+		/* caps handled here */
+		for (cp = caps, k2 = k; k2 < ps->ps_nent; k2++) {
+			bp = tt->pentries + ps->ps_base + k2;
+			if (done[k2] == k && bp->pt_cap[0] &&
+			    cp < caps + sizeof caps - 4)
+				cp += sprintf(cp, " %2.2s", bp->pt_cap);
+		}
+		*cp = '\0';
+
+		if (k == best)
+			l = line + sprintf(line, "default:");
+		else {
+			for (c = 0, l = line; c < 128; c++) {
+				if (done[ps->ps_class[c]] != k)
+					continue;
+				if (l - line > 60) {
+					put("%s", line);
+					l = line;
+				}
+				l += sprintf(l, "%scase %s:", l == line ? "" : " ",
+					     char_const(c));
+			}
+		}
+		if (caps[0])
+			sprintf(l, "\t/*%s */", caps);
+		put("%s", line);
+		if (pp->pt_nsteps > 0)
+			put_start(ps->ps_base + k, 0, nump[st]);
+		else
+			put_action(pp, nump[st], st == 0);
+	}
+	depth--;
+	put("}");
+}
+
+/* generate a translator function for the current parse table */
+void gen(char *fn)
+{
+	struct pentry *pp;
+	char *body;
+	size_t blen;
+	int st, e, n, k, j, room, nlab;
+
+	/* args parsed before each state, states for entries' steps */
+	nump = calloc(tt->npstates, sizeof *nump);
+	st = tt->npstates - 1;
+	label = calloc(tt->pstates[st].ps_base + tt->pstates[st].ps_nent,
+		       sizeof *label);
+	nlab = tt->npstates;
+	room = 0;
+	for (st = 0; st < tt->npstates; st++) {
+		for (k = 0; k < tt->pstates[st].ps_nent; k++) {
+			e = tt->pstates[st].ps_base + k;
+			pp = tt->pentries + e;
+			if (pp->pt_action == AC_NEXT)
+				nump[pp->pt_next] = nump[st] + pp->pt_nsteps;
+			if (pp->pt_action > AC_PRINT &&
+			    (n = pp->pt_emit->em_len[0] + pp->pt_emit->em_len[1]
+					+ pp->pt_emit->em_len[2]) > room)
+				room = n;
+			if (pp->pt_nsteps == 0)
+				continue;
+			label[e] = nlab;
+			for (j = 0; j < pp->pt_nsteps; j++)
+				nlab += nsub(pp->pt_steps[j].pt_initial);
+		}
+	}
+	room += 20;		/* two numeric args */
+
+	/* generate the switch first, to see what it needs */
+	need_v = need_p = need_again = need_twice = 0;
+	out = open_memstream(&body, &blen);
+	depth = 3;
+	for (st = 0; st < tt->npstates; st++)
+		put_state(st);
+	for (st = 0; st < tt->npstates; st++) {
+		for (k = 0; k < tt->pstates[st].ps_nent; k++) {
+			e = tt->pstates[st].ps_base + k;
+			if (tt->pentries[e].pt_nsteps > 0)
+				put_steps(e, nump[st]);
+		}
+	}
+	fclose(out);
+	if (need_twice)
+		room *= 2;
+
+	printf("static int %s(struct emu *e, unsigned char *s, int n)\n{\n", fn);
+	printf(need_p ? "\tint pos = e->xl_pos, *p = e->xl_p;\n"
+		      : "\tint pos = e->xl_pos;\n");
+	printf("\tunsigned char *end = s + n;\n");
+	printf("\tchar *d = e->obuf + e->olen;\n");
+	printf(need_v ? "\tint c, v;\n\n" : "\tint c;\n\n");
+	printf("\tfor ( ; s < end; s++) {\n"
+	       "\t\t/* at the root, copy a run of printable chars in bulk */\n"
+	       "\t\tif (pos == 0 && e->scan_print) {\n"
+	       "\t\t\tn = e->scan_print(e, s, MIN(end - s, e->obuf +\n"
+	       "\t\t\t\t\t\t    sizeof e->obuf - d), d);\n"
+	       "\t\t\td += n;\n"
+	       "\t\t\tif ((s += n) == end)\n"
+	       "\t\t\t\tbreak;\n"
+	       "\t\t}\n"
+	       "\t\tif (d > e->obuf + sizeof e->obuf - %d) {\n"
+	       "\t\t\te->olen = d - e->obuf;\n"
+	       "\t\t\tif (flush_output(e) < 0) {\n"
+	       "\t\t\t\te->xl_pos = pos;\n"
+	       "\t\t\t\treturn -1;\n"
+	       "\t\t\t}\n"
+	       "\t\t\td = e->obuf;\n"
+	       "\t\t}\n"
+	       "\t\tc = *s & 0x7f;\t/* strip parity bit */\n", room);
+	if (need_again)
+		printf("again:\n");
+	printf("\t\tswitch (pos) {\n");
+	fwrite(body, 1, blen, stdout);
+	printf("\t\t}\n\t}\n\te->olen = d - e->obuf;\n\te->xl_pos = pos;\n"
+	       "\treturn 0;\n}\n");
+	free(body);
+	free(nump);
+	free(label);
+}
+
+
+void usage(int ec)
+{
+	fprintf(stderr, "Usage: %s termtype...\n", prog);
+	fprintf(stderr, "Write C source for specialized output translators "
+			"to stdout.\n");
+	exit(ec);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct winsize ws = { 24, 80 };
+	unsigned long long *sig;
+	char errbuf[128];
+	int i;
+
+	prog = strrchr(argv[0], '/');
+	prog = prog ? prog+1 : argv[0];
+	if (argc < 2 || argv[1][0] == '-')
+		usage(argc < 2 || strcmp(argv[1], "-h") != 0);
+
+	sig = calloc(argc, sizeof *sig);
+	printf("/*\n * Specialized output translators, generated by %s.  "
+	       "Do not edit.\n */\n\n", prog);
+	printf("#include <string.h>\n#include <time.h>\n"
+	       "#include <sys/ioctl.h>\n#include \"emuterm.h\"\n"
+	       "#include \"output.h\"\n#include \"screen.h\"\n"
+	       "#include \"xlate.h\"\n");
+	for (i = 1; i < argc; i++) {
+		if (!(tt = emu_new(argv[i], &ws, errbuf))) {
+			fprintf(stderr, "%s: %s: %s\n", prog, argv[i], errbuf);
+			exit(1);
+		}
+		if (tt->term_vt) {
+			fprintf(stderr, "%s: %s: ANSI-style terminals use "
+					"xlate_vt\n", prog, argv[i]);
+			exit(1);
+		}
+		if (tt->npalts) {
+			fprintf(stderr, "%s: %s: conflicting capabilities "
+					"need xlate_generic\n", prog, argv[i]);
+			exit(1);
+		}
+		sig[i] = pt_sig(tt);
+		printf("\n\n/* %s */\n", argv[i]);
+		gen(func_name(argv[i]));
+		emu_free(tt);
+	}
+
+	printf("\n\nstruct xlate xlates[] = {\n");
+	for (i = 1; i < argc; i++)
+		printf("\t{ \"%s\", 0x%016llxULL, %s },\n",
+		       argv[i], sig[i], func_name(argv[i]));
+	printf("\t{ NULL }\n};\n");
+	free(sig);
+	return 0;
+}
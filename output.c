@@ -19,18 +19,30 @@
  * Translate output from emulated terminal into xterm control sequences.
  */
 
+#define _GNU_SOURCE	/* for splice, tee */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <time.h>
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "emuterm.h"
+#include "emu.h"
 #include "output.h"
+#include "screen.h"
 #include "termcap.h"
+#include "xlate.h"
+#include "trace.h"
+#include "uring.h"
 
 
 #define ANSI_CLEAR	    "\e[H\e[2J"
@@ -51,17 +63,66 @@
 #define DEC_MARGINS_OFF	    "\e[?69l"
 #define DEC_MARGINS_SET	    "\e[1;%ds"
 
-int term_set, term_am, term_hz;
-int term_cols, term_lines;
+char arrow_caps[] = "kukdkrkl";	/* up, down, right, left */
 
-char *term_arrows[4] = {"", "", "", ""};    /* up, down, right, left */
-char arrow_caps[] = "kukdkrkl";
 
+struct winsize ows;		/* user's window, before any resizing */
+
+/* set up the user's terminal for the terminal type, or undo it */
+void oterm(int on)
+{
+	struct emu *e = emu_cur;
+
+	if (!e->term_set)
+		return;
+	if (on) {
+
+		/* resize user terminal */
+		if (resize_win)
+			dprintf(STDOUT_FILENO, ANSI_RESIZE,
+				e->term_lines, e->term_cols);
+
+		/* else change scroll region and margins */
+		else {
+			dprintf(STDOUT_FILENO,
+				ANSI_SCROLL_REGION ANSI_CLEAR,
+				e->term_lines);
+
+			/* XXX doesn't seem to work */
+			if (e->term_cols != ows.ws_col)
+				dprintf(STDOUT_FILENO,
+					DEC_MARGINS_ON DEC_MARGINS_SET,
+					e->term_cols);
+		}
+
+		/* disable autowrap if needed */
+		if (!e->term_am)
+			dprintf(STDOUT_FILENO, DEC_AUTOWRAP_OFF);
+	} else {
+
+		/* restore user terminal size */
+		if (resize_win)
+			dprintf(STDOUT_FILENO, ANSI_RESIZE,
+				ows.ws_row, ows.ws_col);
+
+		/* else reset scroll region and margins */
+		else {
+			dprintf(STDOUT_FILENO,
+				ANSI_SCROLL_RESET ANSI_SET_ROW,
+				e->term_lines);
+			if (e->term_cols != ows.ws_col)
+				dprintf(STDOUT_FILENO, DEC_MARGINS_OFF);
+		}
+
+		/* re-enable autowrap if needed */
+		if (!e->term_am)
+			dprintf(STDOUT_FILENO, DEC_AUTOWRAP_ON);
+	}
+}
 
 void omode(int raw)
 {
 	static struct termios otio;
-	static struct winsize ows;
 
 	if (raw) {
 		struct termios ntio;
@@ -72,52 +133,16 @@ void omode(int raw)
 		cfmakeraw(&ntio);
 		tcsetattr(STDIN_FILENO, TCSANOW, &ntio);
 
-		if (term_set) {
-			ioctl(STDIN_FILENO, TIOCGWINSZ, &ows);
-
-			/* resize user terminal */
-			if (resize_win)
-				dprintf(STDOUT_FILENO, ANSI_RESIZE,
-					term_lines, term_cols);
-
-			/* else change scroll region and margins */
-			else {
-				dprintf(STDOUT_FILENO,
-					ANSI_SCROLL_REGION ANSI_CLEAR,
-					term_lines);
-
-				/* XXX doesn't seem to work */
-				if (term_cols != ows.ws_col)
-					dprintf(STDOUT_FILENO,
-						DEC_MARGINS_ON DEC_MARGINS_SET,
-						term_cols);
-			}
+		ioctl(STDIN_FILENO, TIOCGWINSZ, &ows);
+		if (emu_cur->term_set) {
+			oterm(1);
 
-			/* disable autowrap if needed */
-			if (!term_am)
-				dprintf(STDOUT_FILENO, DEC_AUTOWRAP_OFF);
+			/* the screen was cleared unless resized */
+			if (ocps || scr_ff || scr_keep)
+				scr_start(emu_cur, !resize_win);
 		}
 	} else {
-		if (term_set) {
-
-			/* restore user terminal size */
-			if (resize_win)
-				dprintf(STDOUT_FILENO, ANSI_RESIZE,
-					ows.ws_row, ows.ws_col);
-
-			/* else reset scroll region and margins */
-			else {
-				dprintf(STDOUT_FILENO,
-					ANSI_SCROLL_RESET ANSI_SET_ROW,
-					term_lines);
-				if (term_cols != ows.ws_col)
-					dprintf(STDOUT_FILENO, DEC_MARGINS_OFF);
-			}
-
-			/* re-enable autowrap if needed */
-			if (!term_am)
-				dprintf(STDOUT_FILENO, DEC_AUTOWRAP_ON);
-		}
+		oterm(0);
 
 		/* restore tty settings */
 		tcsetattr(STDIN_FILENO, TCSANOW, &otio);
@@ -125,19 +150,22 @@ void omode(int raw)
 }
 
 
-int savefd = -1;
-
+/* start or stop recording emu_cur's output (~w) */
 void save_output(char *path)
 {
-	if (savefd >= 0) {
+	struct emu *e = emu_cur;
+
+	if (e->savefd >= 0) {
 		if (!path || !path[0]) {
-			dprintf(STDOUT_FILENO, "Recording stopped\r\n");
-			close(savefd);
-			savefd = -1;
+			out_msg("Recording stopped\r\n");
+			if (ur_on)
+				ur_drain(e->savefd);
+			close(e->savefd);
+			e->savefd = -1;
 			return;
 		}
 
-		dprintf(STDOUT_FILENO, "Recording already in progress, "
+		out_msg("Recording already in progress, "
 				       "use ~w to stop\r\n");
 		return;
 	}
@@ -148,110 +176,1202 @@ void save_output(char *path)
 	if (path[0] == ' ')	/* skip optional space after "~w" */
 		path++;
 	if (!path[0]) {
-		dprintf(STDOUT_FILENO, "No recording in progress, "
+		out_msg("No recording in progress, "
 				       "use ~? for help\r\n");
 		return;
 	}
 
-	if ((savefd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0666)) < 0) {
-		dprintf(STDOUT_FILENO, "%s: %s\r\n", path, strerror(errno));
+	if ((e->savefd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0666)) < 0) {
+		out_msg("%s: %s\r\n", path, strerror(errno));
 		return;
 	}
-	dprintf(STDOUT_FILENO, "Recording to '%s'\r\n", path);
+	out_msg("Recording to '%s'\r\n", path);
 }
 
 
-/* parse table for output */
-enum action {
-	AC_IGNORE = 0,		  /* no action (default) */
-	AC_NEXT,		  /* continue to next parse table */
-	AC_PRINT = AC_NEXT+1,	  /* print as-is */
-	AC_FMT,			  /* print constant string */
-	AC_FMT1 = AC_FMT+1,	  /* format string w/1 integer argument */
-	AC_FMT2 = AC_FMT1+1,	  /* format string w/2 integer arguments */
-	AC_FMT2_REV = AC_FMT2+1,  /* AC_FMT2 w/args swapped */
-	AC_LL = AC_FMT2_REV+1,    /* format string w/#lines */
-	AC_STLINE = AC_LL+1,	  /* AC_FMT, optional argument ignored */
-};
+/*
+ * Write all of buf to fd, return -1 on error.  If fd is non-blocking (the
+ * master is), wait for it if necessary.
+ */
+int write_all(int fd, char *buf, int len)
+{
+	struct pollfd pfd;
+	int n;
+
+	for ( ; len > 0; buf += n, len -= n) {
+		if ((n = write(fd, buf, len)) >= 0)
+			continue;
+		n = 0;
+		if (errno == EAGAIN) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			(void) poll(&pfd, 1, -1);
+		} else if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
 
-enum state {
-	ST_UNSET = 0,
-	ST_NEXT,		  /* continue to next step */
-	ST_GET_1C,		  /* consume 1 char,   for %. and %+ */
-	ST_GET_DIGITS,		  /* any # of digits,  for %d */
-	ST_GET_3D,		  /* consume 3 digits, for %3 */
-	ST_GET_2D = ST_GET_3D+1,  /* consume 2 digits, for %2 and %3 */
-	ST_GET_1D = ST_GET_2D+1,  /* consume 1 digit,  for %2 and %3 */
-};
 
-struct pentry {
-	struct step {
-		short	    pt_inc;	/* termcap %i or %+X */
-		enum state  pt_initial;
-	} pt_steps[2];			/* arg parsing steps */
-	short		pt_nsteps;
-	char		pt_cap[2];	/* capability that this came from */
-	enum action	pt_action;
-	void		*pt_ptr;	/* fmt or next parsetab */
-} parsetab[128] = { { .pt_action = AC_IGNORE, .pt_ptr = NULL } };
+/*
+ * Output to the user is written without blocking: stdout is non-blocking,
+ * and what the user's tty won't take yet is queued at uq, and written by
+ * flush_user() when the event loop finds stdout writable.  Once UQ_HIGH
+ * bytes are queued, the master isn't read, so a stalled terminal or ssh
+ * link holds up the child rather than emuterm, which keeps handling the
+ * user's input and the file being sent.  The queue can exceed UQ_HIGH by
+ * what one read from the master translates to.
+ */
+#define UQ_HIGH		65536
 
+char *uq = NULL;
+int uq_off = 0, uq_len = 0, uq_size = 0;
 
-void dump_pt(struct pentry *pt, int indent)
+int out_hidden = 0;		/* a background session's, see bg_output() */
+
+/* write buf to the user, or queue what can't be written yet */
+int write_user(char *buf, int len)
 {
-	struct pentry *pp;
-	int i, j;
-	unsigned char *s;
+	char *nq;
+	int n, size;
+
+	if (out_hidden)
+		return 0;
+	if (ur_on)
+		return ur_write(STDOUT_FILENO, buf, len);
+	for ( ; !uq_len && len > 0; buf += n, len -= n) {
+		if ((n = write(STDOUT_FILENO, buf, len)) >= 0)
+			continue;
+		if (errno == EAGAIN)
+			break;
+		if (errno != EINTR)
+			return -1;
+		n = 0;
+	}
+	if (len <= 0)
+		return 0;
 
-	for (i = 0, pp = pt; i < 128; i++, pp++) {
-		if (pp->pt_action == ((pt == parsetab && i >= 32) ? AC_PRINT
-								  : AC_IGNORE))
+	if (uq_off && uq_off + uq_len + len > uq_size) {
+		memmove(uq, uq + uq_off, uq_len);
+		uq_off = 0;
+	}
+	if (uq_len + len > uq_size) {
+		size = MAX(MAX(2*uq_size, UQ_HIGH), uq_len + len);
+		if (!(nq = realloc(uq, size)))
+			return -1;
+		uq = nq;
+		uq_size = size;
+	}
+	memcpy(uq + uq_off + uq_len, buf, len);
+	uq_len += len;
+	return 0;
+}
+
+/* write as much queued output as the user's tty will take */
+int flush_user(void)
+{
+	int n;
+
+	if (ur_on)
+		return ur_error(STDOUT_FILENO);
+	while (uq_len > 0) {
+		if ((n = write(STDOUT_FILENO, uq + uq_off, uq_len)) < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno != EINTR)
+				return -1;
 			continue;
-		if (indent)
-			fprintf(stderr, "%*s",  indent, "");
-		fprintf(stderr, i > 32 && i < 127 ? "  %c=" : "%03o=", i);
-		for (j = 0; j < pp->pt_nsteps; j++) {
-			fprintf(stderr, "%2.2s",
-			       "--nx1cdd3d2d1d" + 2*pp->pt_steps[j].pt_initial);
-			if (pp->pt_steps[j].pt_inc)
-				fprintf(stderr, "+%d", pp->pt_steps[j].pt_inc);
-			fputc(',', stderr);
 		}
-		switch (pp->pt_action) {
-		    case AC_IGNORE:
-		        fprintf(stderr, "ignore"); break;
+		uq_off += n;
+		uq_len -= n;
+	}
+	uq_off = 0;
+	return 0;
+}
+
+/* write all queued output, waiting for the user's tty if necessary */
+int drain_user(void)
+{
+	struct pollfd pfd;
+
+	if (ur_on)
+		return ur_drain(STDOUT_FILENO);
+	while (uq_len > 0) {
+		if (flush_user() < 0)
+			return -1;
+		if (uq_len) {
+			pfd.fd = STDOUT_FILENO;
+			pfd.events = POLLOUT;
+			(void) poll(&pfd, 1, -1);
+		}
+	}
+	return 0;
+}
+
+/* is too much output queued to read more from the master? */
+int user_full(void)
+{
+	return (ur_on ? ur_queued(STDOUT_FILENO) : uq_len) >= UQ_HIGH;
+}
+
+
+/*
+ * Translated output is collected here and written to the user once per
+ * read from the slave, rather than a write() for every character.
+ *
+ * With -l, output is held for up to coalesce_us microseconds after it is
+ * first queued, so a child that writes a byte at a time doesn't cost a
+ * write per byte.  It's written sooner if coalesce_max (-m) bytes are
+ * queued, if no more output arrives for OIDLE_US, or on user input.
+ */
+#define OIDLE_US	1000
+
+long coalesce_us = 0;
+int coalesce_max = OBUF_SIZE;
+
+/* write e's translated output to its sink, or the user */
+int flush_output(struct emu *e)
+{
+	int rv, k;
+
+	if (e->sink)
+		rv = e->olen ? (*e->sink)(e->obuf, e->olen) : 0;
+	else {
+		/* while collapsing, some or all of it only goes to the screen */
+		k = e->scr_on ? scr_output(e, e->obuf, e->olen) : 0;
+		rv = k < 0 ? -1 : write_user(e->obuf + k, e->olen - k);
+		if (rv >= 0 && e->scr_on && e->olen && !out_hidden)
+			rv = scr_echoed();
+	}
+	e->olen = 0;
+	e->ofirst = 0;
+	return rv;
+}
+
+/*
+ * With -c, output is paced to ocps chars per second.  Char n after pacing
+ * (re)starts at pace_t0 is due at pace_t0 + n/ocps seconds, so waking late
+ * doesn't accumulate: the chars that came due meanwhile are released
+ * together, in one write.  If output stops for longer than PACE_IDLE_NS,
+ * pacing restarts, rather than releasing a burst of chars once it resumes.
+ * At rates over a char per PACE_TICK_NS, the loop waits for a tick's worth
+ * to come due, so a write carries several chars rather than one.
+ *
+ * Each read from the slave is queued at pq, untranslated, and released
+ * by check_output() as it comes due, so the event loop keeps handling
+ * user input.  The slave isn't read again until the queue is empty.
+ */
+#define PACE_IDLE_NS	50000000LL
+#define PACE_TICK_NS	10000000LL	/* shortest wait between writes */
+
+int ocps = 0;
+long long pace_t0 = 0, pace_n = 0;
+unsigned char *pq;
+int pq_len = 0;
+
+/*
+ * Return nanoseconds until the next chars paced at cps from *t0, *n are
+ * due: a tick's worth, or at least one.  (Input is paced the same way, see
+ * handle_input.)
+ */
+long long pace_wait(long long *t0, long long *n, int cps)
+{
+	long long now = mono_ns(), due;
+	long long k = MAX(1, PACE_TICK_NS * cps / 1000000000);
+
+	/* keep the arithmetic small: advance *t0 a second at a time */
+	while (*n >= cps) {
+		*t0 += 1000000000;
+		*n -= cps;
+	}
+	due = *t0 + (*n+k) * 1000000000 / cps;
+	if (now - due > PACE_IDLE_NS) {
+		*t0 = now;
+		*n = 0;
+		due = now + k * 1000000000 / cps;
+	}
+	return due > now ? due - now : 0;
+}
+
+/* change the paced rate (0 = none), restarting pacing without a burst */
+int set_pace(int cps)
+{
+	struct emu *e = emu_cur;
+	int rv = 0;
+
+	if (!cps && pq_len) {
+		rv = (*e->xlate)(e, pq, pq_len);
+		pq_len = 0;
+		if (rv >= 0)
+			rv = flush_output(e);
+	}
+	if (!e)			/* no session yet: omode() starts it */
+		;
+	else if (cps && !e->scr_on)
+		scr_start(e, 0);
+	else if (!cps && !scr_ff && !scr_keep)
+		e->scr_on = 0;
+	ocps = cps;
+	pace_t0 = mono_ns();
+	pace_n = 0;
+	return rv;
+}
+
+/* translate and write the queued chars that are due */
+int pace_output(void)
+{
+	struct emu *e = emu_cur;
+	int n, rv;
+
+	if (!pq_len || pace_wait(&pace_t0, &pace_n, ocps) > 0)
+		return 0;
+	n = (mono_ns() - pace_t0) * ocps / 1000000000 - pace_n;
+	n = MAX(1, MIN(n, pq_len));
+	pace_n += n;
+	rv = (*e->xlate)(e, pq, n);
+	pq += n;
+	pq_len -= n;
+	return rv < 0 ? rv : flush_output(e);
+}
+
+/*
+ * Translate what's left of the paced queue at once, into the virtual
+ * screen only, e.g. when another session is shown.
+ */
+int hide_output(void)
+{
+	struct emu *e = emu_cur;
+	int rv;
+
+	if (!pq_len)
+		return 0;
+	out_hidden = 1;
+	rv = (*e->xlate)(e, pq, pq_len);
+	pq_len = 0;
+	if (rv >= 0)
+		rv = flush_output(e);
+	out_hidden = 0;
+	return rv;
+}
+
+/* return nanoseconds until queued output is due, or -1 if none queued */
+long long output_wait(void)
+{
+	struct emu *e = emu_cur;
+	long long now, due;
+	long long pw = pq_len ? pace_wait(&pace_t0, &pace_n, ocps) : scr_wait();
+
+	if (!e->olen)
+		return pw;
+	if (!coalesce_us || e->olen >= coalesce_max)
+		return 0;
+	due = MIN(e->ofirst + coalesce_us*1000,
+		  e->olast + MIN(coalesce_us, OIDLE_US)*1000);
+	now = mono_ns();
+	due = due > now ? due - now : 0;
+	return pw >= 0 ? MIN(pw, due) : due;
+}
+
+/* write queued output if it's due */
+int check_output(void)
+{
+	if (pace_output() < 0 || scr_check() < 0)
+		return -1;
+	return emu_cur->olen && output_wait() == 0 ? flush_output(emu_cur) : 0;
+}
+
+int out_write(struct emu *e, char *s, int n)
+{
+	if (e->olen + n > sizeof e->obuf && flush_output(e) < 0)
+		return -1;
+	if (n > sizeof e->obuf)
+		return e->sink ? (*e->sink)(s, n) : write_user(s, n);
+	memcpy(e->obuf + e->olen, s, n);
+	e->olen += n;
+	return n;
+}
+
+/* write a message to the user, after the output, as if it were output */
+void out_msg(char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof buf, fmt, ap);
+	va_end(ap);
+	if (n > 0 && out_write(emu_cur, buf, MIN(n, sizeof buf - 1)) >= 0)
+		flush_output(emu_cur);
+}
+
+
+
+/*
+ * Pass-through without pacing: move output from slave to user (and to
+ * the recording, if any) with splice and tee so it is never copied into
+ * user space.  If splice isn't supported for these fds, fall back to
+ * large reads and writes.  (With -u, output is read and queued by the
+ * io_uring, as when translated.)
+ */
+int splice_out = 1, splice_save = 1;
+
+/* copy len bytes from pipe pfd to user and/or recording savefd (or -1) */
+int copy_pipe(int pfd, int len, int to_user, int savefd)
+{
+	char buf[4096];
+	int n;
+
+	for ( ; len > 0; len -= n) {
+		if ((n = read(pfd, buf, MIN(len, sizeof buf))) <= 0)
+			return -1;
+		if (savefd >= 0)
+			write(savefd, buf, n);
+		if (to_user && write_user(buf, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int pass_output(int mfd)
+{
+	static int pfd[2] = { -1, -1 };	/* slave -> user */
+	static int rfd[2] = { -1, -1 };	/* tee'd copy for recording */
+	static char *big = NULL;
+	int savefd = emu_cur->savefd;
+	int rc, n, left, save = 0;
+
+	if (splice_out && pfd[0] < 0 && pipe(pfd) < 0)
+		splice_out = 0;
+	if (!splice_out)
+		goto copy;
+
+	if ((rc = splice(mfd, NULL, pfd[1], NULL, rsize_max, 0)) < 0) {
+		if (errno != EINVAL)
+			return rc;
+		splice_out = 0;
+		goto copy;
+	}
+	if (rc == 0)
+		return rc;
+
+	/* duplicate the data for the recording */
+	if (savefd >= 0) {
+		if (rfd[0] < 0 && pipe(rfd) < 0)
+			rfd[0] = -1;
+		n = rfd[0] < 0 ? -1 : tee(pfd[0], rfd[1], rc, 0);
+		if (n != rc) {
+			if (n > 0)	/* discard partial copy */
+				copy_pipe(rfd[0], n, 0, -1);
+			save = 1;	/* record while copying to user */
+		} else {
+			for (left = rc; left > 0 && splice_save; left -= n) {
+				n = splice(rfd[0], NULL, savefd, NULL, left, 0);
+				if (n <= 0) {
+					/* e.g. EINVAL for O_APPEND files */
+					splice_save = 0;
+					break;
+				}
+			}
+			if (left > 0)
+				copy_pipe(rfd[0], left, 0, savefd);
+		}
+	}
+
+	/* once the user's tty is full, queue the rest (in order) */
+	for (left = rc; left > 0 && !save && !uq_len; left -= n) {
+		n = splice(pfd[0], NULL, STDOUT_FILENO, NULL, left, 0);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0 && errno == EAGAIN)
 			break;
+		else if (n <= 0) {
+			splice_out = 0;
+			break;
+		}
+	}
+	if (left > 0 && copy_pipe(pfd[0], left, 1, save ? savefd : -1) < 0)
+		return -1;
+	return rc;
+
+copy:
+	if (!big && !(big = malloc(rsize_max)))
+		return -1;
+	if ((rc = read(mfd, big, rsize_max)) <= 0)
+		return rc;
+	if (savefd >= 0)
+		write(savefd, big, rc);
+	if (write_user(big, rc) < 0)
+		return -1;
+	return rc;
+}
 
-		    case AC_NEXT:
-			fprintf(stderr, "{\r\n");
-			dump_pt(pp->pt_ptr, indent+4);
-			fprintf(stderr, "%*s}",  indent+4, "");
+
+/*
+ * add_parse() builds the parse table for output, e->parsetab, as a tree
+ * of 128-entry tables.  Once complete, freeze_pt() converts it to a
+ * compact state machine: each table becomes a state with a map from
+ * character to class, where each class is a distinct entry in that
+ * state.  All states' entries are stored contiguously in e->pentries.
+ *
+ * Where capabilities conflict, e.g. one is a prefix of another or has an
+ * argument where another has a literal, an entry has a chain of
+ * alternatives (pt_alt, stored in palts once frozen).  If the output
+ * doesn't match, xlate_generic() takes the next alternative and replays
+ * the characters it had consumed since.
+ */
+
+/*
+ * Replacement strings are compiled by freeze_pt() into emitters: literal
+ * fragments around up to two integer arguments, so xlate_generic()
+ * doesn't parse a printf format for every control sequence.
+ */
+struct emit *compile_emit(struct emu *e, char *rep)
+{
+	struct emit *em;
+	char *d;
+	int i;
+
+	/* emitters are shared by entries with the same replacement */
+	for (i = 0; i < e->nemits; i++) {
+		if (e->emits[i]->em_rep == rep)
+			return e->emits[i];
+	}
+	if (!(e->nemits & (e->nemits-1)) &&
+	    !(e->emits = realloc(e->emits, 2*(e->nemits ? e->nemits : 1) * sizeof *e->emits)))
+		return NULL;
+	if (!(em = calloc(1, sizeof *em + strlen(rep) + 1)))
+		return NULL;
+	e->emits[e->nemits++] = em;
+
+	em->em_rep = rep;
+	em->em_frag[0] = d = (char *)(em + 1);
+	for ( ; *rep; rep++) {
+		if (*rep != '%') {
+			*d++ = *rep;
+			continue;
+		}
+		if (*++rep == 'd' && em->em_nargs < 2) {
+			em->em_len[em->em_nargs] = d - em->em_frag[em->em_nargs];
+			em->em_frag[++em->em_nargs] = d;
+		} else if (*rep == '%')
+			*d++ = '%';
+		else if (!*rep)
 			break;
+	}
+	em->em_len[em->em_nargs] = d - em->em_frag[em->em_nargs];
+	return em;
+}
 
-		    case AC_PRINT:
-		        fprintf(stderr, "print"); break;
+void free_emits(struct emu *e)
+{
+	while (e->nemits > 0)
+		free(e->emits[--e->nemits]);
+}
+
+/* append emitter output with args a0, a1 to e->obuf */
+int out_emit(struct emu *e, struct emit *em, unsigned a0, unsigned a1)
+{
+	char *d;
+
+	if (e->olen + em->em_len[0] + em->em_len[1] + em->em_len[2] + 20
+							> sizeof e->obuf &&
+	    flush_output(e) < 0)
+		return -1;
+	d = e->obuf + e->olen;
+	memcpy(d, em->em_frag[0], em->em_len[0]);
+	d += em->em_len[0];
+	if (em->em_nargs > 0) {
+		d = put_dec(d, a0);
+		memcpy(d, em->em_frag[1], em->em_len[1]);
+		d += em->em_len[1];
+	}
+	if (em->em_nargs > 1) {
+		d = put_dec(d, a1);
+		memcpy(d, em->em_frag[2], em->em_len[2]);
+		d += em->em_len[2];
+	}
+	e->olen = d - e->obuf;
+	return 0;
+}
+
+/* cursor motion, through e->cmcache (see xlate.h) */
+#if CM_CACHE
+int out_cm(struct emu *e, struct emit *em, unsigned row, unsigned col)
+{
+	struct cmcache *cc = e->cmcache + (row * 7 + col) % CM_CACHE;
+	int len;
+
+	if (cc->cc_emit == em && cc->cc_row == row && cc->cc_col == col)
+		return out_write(e, cc->cc_buf, cc->cc_len);
+
+	len = e->olen;
+	if (out_emit(e, em, row, col) < 0)
+		return -1;
+	if ((len = e->olen - len) <= sizeof cc->cc_buf) {
+		cc->cc_emit = em;
+		cc->cc_row = row;
+		cc->cc_col = col;
+		cc->cc_len = len;
+		memcpy(cc->cc_buf, e->obuf + e->olen - len, len);
+	}
+	return 0;
+}
+#else
+#define out_cm(e, em, row, col)	out_emit(e, em, row, col)
+#endif
+
+
+void dump_pt(struct emu *e, int st, int indent);
+
+void dump_pe(struct emu *e, struct pentry *pp, int indent)
+{
+	unsigned char *s;
+	int j;
+
+	for (j = 0; j < pp->pt_nsteps; j++) {
+		fprintf(stderr, "%2.2s",
+		       "--nx1cdd3d2d1d" + 2*pp->pt_steps[j].pt_initial);
+		if (pp->pt_steps[j].pt_inc)
+			fprintf(stderr, "+%d", pp->pt_steps[j].pt_inc);
+		fputc(',', stderr);
+	}
+	switch (pp->pt_action) {
+	    case AC_IGNORE:
+		fprintf(stderr, "ignore"); break;
+		break;
+
+	    case AC_NEXT:
+		fprintf(stderr, "{\r\n");
+		dump_pt(e, pp->pt_next, indent+4);
+		fprintf(stderr, "%*s}",  indent+4, "");
+		break;
+
+	    case AC_PRINT:
+		fprintf(stderr, "print"); break;
+		break;
+
+	    default:  /* AC_FMT*, AC_LL, AC_STLINE, AC_REGION */
+		fputc('"', stderr);
+		for (s = pp->pt_emit->em_rep; *s; s++)
+			fprintf(stderr, *s == '\\' ? "\\%c" :
+				*s >= 32 && *s < 127 ? "%c" : "\\%03o",
+				*s);
+		fputc('"', stderr);
+		if (pp->pt_action > AC_FMT)
+			fprintf(stderr, ",%c",
+				      " 12RLSW"[pp->pt_action - AC_FMT]);
+	}
+	fprintf(stderr, " [%2.2s]\r\n", pp->pt_cap);
+}
+
+void dump_pt(struct emu *e, int st, int indent)
+{
+	struct pentry *pp;
+	int i;
+
+	for (i = 0; i < 128; i++) {
+		pp = PENTRY(e, st, i);
+		if (pp->pt_action == ((st == 0 && i >= 32) ? AC_PRINT
+							   : AC_IGNORE))
+			continue;
+		fprintf(stderr, i > 32 && i < 127 ? "%*s  %c=" : "%*s%03o=",
+			indent, "", i);
+		dump_pe(e, pp, indent);
+		for (pp = pp->pt_alt; pp; pp = pp->pt_alt) {
+			fprintf(stderr, "%*s   |", indent, "");
+			dump_pe(e, pp, indent);
+		}
+	}
+}
+
+
+/* collect the tables of the parsetab tree in depth-first order */
+int walk_pt(struct pentry *pt, struct pentry ***tabs, int ntabs)
+{
+	struct pentry *ep;
+	int c;
+
+	if (!(ntabs & (ntabs-1))) {	/* grow at powers of 2 */
+		*tabs = realloc(*tabs, 2*(ntabs ? ntabs : 1) * sizeof **tabs);
+		if (!*tabs)
+			return -1;
+	}
+	(*tabs)[ntabs++] = pt;
+	for (c = 0; c < 128 && ntabs > 0; c++) {
+		for (ep = pt + c; ep && ntabs > 0; ep = ep->pt_alt) {
+			if (ep->pt_action == AC_NEXT)
+				ntabs = walk_pt(ep->pt_ptr, tabs, ntabs);
+		}
+	}
+	return ntabs;
+}
+
+int same_pentry(struct pentry *a, struct pentry *b)
+{
+	int j;
+
+	if (a->pt_action != b->pt_action || a->pt_ptr != b->pt_ptr ||
+	    a->pt_alt != b->pt_alt || a->pt_nsteps != b->pt_nsteps ||
+	    a->pt_cap[0] != b->pt_cap[0] || a->pt_cap[1] != b->pt_cap[1])
+		return 0;
+	for (j = 0; j < 2; j++) {
+		if (a->pt_steps[j].pt_inc != b->pt_steps[j].pt_inc ||
+		    a->pt_steps[j].pt_initial != b->pt_steps[j].pt_initial)
+			return 0;
+	}
+	return 1;
+}
+
+/* convert an entry of the tree and its alternatives, return 0 or -1 */
+int freeze_pe(struct emu *e, struct pentry *np, struct pentry *pe,
+	      struct pentry **tabs)
+{
+	int k;
+
+	*np = *pe;
+	if (np->pt_action == AC_NEXT) {
+		for (k = 0; tabs[k] != pe->pt_ptr; k++)
+			;
+		np->pt_ptr = NULL;
+		np->pt_next = k;
+	} else if (np->pt_action > AC_PRINT &&
+		   !(np->pt_emit = compile_emit(e, pe->pt_ptr)))
+		return -1;
+
+	if (pe->pt_alt) {
+		np->pt_alt = e->palts + e->npalts++;
+		return freeze_pe(e, np->pt_alt, pe->pt_alt, tabs);
+	}
+	return 0;
+}
+
+/* convert parsetab tree to e->pstates, return NULL or error message */
+char *freeze_pt(struct emu *e)
+{
+	struct pentry **tabs = NULL, *pt, *ep, ent;
+	int ntabs, nent, nalt, st, c, k, n;
+
+	if ((ntabs = walk_pt(e->parsetab, &tabs, 0)) < 0)
+		return "out of memory";
+	if (ntabs > USHRT_MAX) {	/* pt_next is unsigned short */
+		free(tabs);
+		return "parse table too large";
+	}
+	free(e->pstates);
+	free(e->pentries);
+	free(e->palts);
+	e->npalts = 0;
+	free_emits(e);
+#if CM_CACHE
+	memset(e->cmcache, 0, sizeof e->cmcache);
+#endif
+	for (st = nalt = 0; st < ntabs; st++) {
+		for (c = 0; c < 128; c++) {
+			for (ep = tabs[st][c].pt_alt; ep; ep = ep->pt_alt)
+				nalt++;
+		}
+	}
+	e->pstates = calloc(ntabs, sizeof *e->pstates);
+	e->pentries = calloc(ntabs * 128, sizeof *e->pentries);
+	e->palts = nalt ? calloc(nalt, sizeof *e->palts) : NULL;
+	if (!e->pstates || !e->pentries || nalt && !e->palts) {
+		free(tabs);
+		return "out of memory";
+	}
+
+	for (st = nent = 0; st < ntabs; st++) {
+		if (nent > USHRT_MAX) {		/* so is ps_base */
+			free(tabs);
+			return "parse table too large";
+		}
+		pt = tabs[st];
+		e->pstates[st].ps_base = nent;
+		for (c = n = 0; c < 128; c++) {
+			if (freeze_pe(e, &ent, pt + c, tabs) < 0) {
+				free(tabs);
+				return "out of memory";
+			}
+
+			/* same as an existing entry in this state? */
+			ep = e->pentries + nent;
+			for (k = 0; k < n; k++) {
+				if (same_pentry(ep + k, &ent))
+					break;
+			}
+			if (k == n)
+				ep[n++] = ent;
+			e->pstates[st].ps_class[c] = k;
+		}
+		e->pstates[st].ps_nent = n;
+		nent += n;
+	}
+	/* if it can't shrink, keep it as it is */
+	if (ep = realloc(e->pentries, nent * sizeof *e->pentries))
+		e->pentries = ep;
+	e->npstates = ntabs;
+	free(tabs);
+	return NULL;
+}
+
+void free_pt(struct pentry *pt);
+void vt_free(struct emu *e);
+
+/* free the parse table, frozen or not, and vt candidates */
+void free_xlate(struct emu *e)
+{
+	if (e->parsetab) {
+		free_pt(e->parsetab);
+		free(e->parsetab);
+		e->parsetab = NULL;
+	}
+	free(e->pstates);
+	free(e->pentries);
+	free(e->palts);
+	e->pstates = NULL;
+	e->pentries = e->palts = NULL;
+	e->npstates = e->npalts = 0;
+	free_emits(e);
+	free(e->emits);
+	e->emits = NULL;
+	vt_free(e);
+#if CM_CACHE
+	memset(e->cmcache, 0, sizeof e->cmcache);	/* keyed by emitter */
+#endif
+}
+
+/*
+ * Hash everything about the frozen parse table that a translator
+ * generated by mkxlate depends on, so a stale one is never used.
+ */
+unsigned long long pt_sig(struct emu *e)
+{
+	unsigned long long h = 14695981039346656037ULL;	/* FNV-1a */
+	struct pentry *pp;
+	unsigned char *s;
+	int st, c, j;
+
+#define SIG(v)	(h = (h ^ (unsigned)(v)) * 1099511628211ULL)
+	SIG(e->term_hz);
+	SIG(e->npstates);
+	for (st = 0; st < e->npstates; st++) {
+		for (c = 0; c < 128; c++) {
+			/* the entry, then each alternative to it */
+			for (pp = PENTRY(e, st, c); pp; pp = pp->pt_alt) {
+				SIG(pp->pt_action);
+				SIG(pp->pt_nsteps);
+				for (j = 0; j < pp->pt_nsteps; j++) {
+					SIG(pp->pt_steps[j].pt_inc);
+					SIG(pp->pt_steps[j].pt_initial);
+				}
+				if (pp->pt_action == AC_NEXT)
+					SIG(pp->pt_next);
+				else if (pp->pt_action > AC_PRINT) {
+					for (s = pp->pt_emit->em_rep; *s; s++)
+						SIG(*s);
+					SIG(0);
+				}
+			}
+			SIG(~0);
+		}
+	}
+#undef SIG
+	return h;
+}
+
+/* free what an entry of the parsetab tree points to */
+void free_pe(struct pentry *ep)
+{
+	struct pentry *alt;
+
+	if (ep->pt_action == AC_NEXT) {
+		if (ep->pt_ptr) {	/* else a failed add_parse */
+			free_pt(ep->pt_ptr);
+			free(ep->pt_ptr);
+		}
+		ep->pt_action = AC_IGNORE;
+		ep->pt_ptr = NULL;
+	}
+	while (alt = ep->pt_alt) {
+		ep->pt_alt = alt->pt_alt;
+		alt->pt_alt = NULL;
+		free_pe(alt);
+		free(alt);
+	}
+}
+
+/* free the parsetab tree once frozen */
+void free_pt(struct pentry *pt)
+{
+	int c;
+
+	for (c = 0; c < 128; c++)
+		free_pe(pt + c);
+}
+
+struct pentry *copy_pt(struct pentry *pt);
+
+/* copy an entry of the parsetab tree, return 0 or -1 if out of memory */
+int copy_pe(struct pentry *np, struct pentry *pe)
+{
+	*np = *pe;
+	np->pt_alt = NULL;
+	if (pe->pt_action == AC_NEXT && !(np->pt_ptr = copy_pt(pe->pt_ptr))) {
+		np->pt_action = AC_IGNORE;
+		return -1;
+	}
+	if (pe->pt_alt) {
+		if (!(np->pt_alt = malloc(sizeof *np)))
+			return -1;
+		return copy_pe(np->pt_alt, pe->pt_alt);
+	}
+	return 0;
+}
+
+/* copy the parsetab tree, so a failed add_parse() can be undone */
+struct pentry *copy_pt(struct pentry *pt)
+{
+	struct pentry *np;
+	int c;
+
+	if (!(np = malloc(128 * sizeof *np)))
+		return NULL;
+	memcpy(np, pt, 128 * sizeof *np);
+	for (c = 0; c < 128; c++) {
+		if (copy_pe(np + c, pt + c) < 0)
+			break;
+	}
+	if (c == 128)
+		return np;
+
+	/* out of memory: free only the copies */
+	while (++c < 128) {
+		np[c].pt_action = AC_IGNORE;
+		np[c].pt_alt = NULL;
+	}
+	free_pt(np);
+	free(np);
+	return NULL;
+}
+
+
+/*
+ * Terminals whose "cm" starts with ESC [ use ANSI-style control sequences,
+ * with optional parameters that the parse table can't express.  For them,
+ * xlate_vt() runs a state machine after Paul Williams' DEC VT parser,
+ * which collects the private marker, intermediate, and parameters of each
+ * escape or control sequence and dispatches on its final character.
+ * Each capability that is such a sequence becomes a candidate for that
+ * final character, with the same action and emitter as in the parse table.
+ * Sequences that match no candidate are ignored.  Other characters are
+ * handled by the root of the parse table.
+ */
+#define VT_NSEQ		4		/* sequences per capability */
+
+enum vt_kind { VK_ESC = 0, VK_CSI };
+
+struct vtcand {
+	struct vtcand	*vc_next;	/* next for the same final */
+	char		vc_cap[2];
+	unsigned char	vc_kind;	/* enum vt_kind */
+	unsigned char	vc_priv;	/* CSI private marker <=>? or 0 */
+	unsigned char	vc_inter;	/* intermediate char or 0 */
+	unsigned char	vc_final;
+	unsigned char	vc_piece;	/* one of several in capability */
+	short		vc_nparam;
+	short		vc_param[VT_NPARAM];  /* value, or -1 for argument */
+	short		vc_argpos[2];	/* index in vc_param of arguments */
+	short		vc_inc;		/* termcap %i */
+	enum action	vc_action;
+	char		*vc_rep;	/* malloc'ed if vc_piece */
+	struct emit	*vc_emit;
+};
+
+void vt_free(struct emu *e)
+{
+	struct vtcand *vc;
+	int k, f;
+
+	for (k = 0; k < 2; k++) {
+		for (f = 0; f < 0x7f - 0x30; f++) {
+			while (vc = e->vt_cands[k][f]) {
+				e->vt_cands[k][f] = vc->vc_next;
+				if (vc->vc_piece)
+					free(vc->vc_rep);
+				free(vc);
+			}
+		}
+	}
+}
+
+/* parse the sequence at *sp into vc and advance, return error or NULL */
+char *vt_parse_cap(char **sp, struct vtcand *vc, int *nargs, int *rev)
+{
+	char *s = *sp;
+	int n = 0, v = 0, have = 0;
+
+	if (*s++ != '\033')
+		return "not an escape sequence";
+	if (*s == '[') {
+		vc->vc_kind = VK_CSI;
+		if (*++s >= '<' && *s <= '?')
+			vc->vc_priv = *s++;
+		for ( ; ; s++) {
+			if (*s >= '0' && *s <= '9') {
+				v = v*10 + *s - '0';
+				have = 1;
+			} else if (*s == '%' && s[1] == 'i') {
+				vc->vc_inc = 1;
+				s++;
+			} else if (*s == '%' && s[1] == 'r') {
+				*rev = 1;
+				s++;
+			} else if (*s == '%' && (s[1] == 'd' || s[1] == '2' ||
+						 s[1] == '3')) {
+				if (*nargs >= 2)
+					return "too many arguments";
+				vc->vc_argpos[(*nargs)++] = n;
+				v = -1;
+				have = 1;
+				s++;
+			} else if (*s == '%')
+				return "unsupported % escape";
+			else if (*s == ';') {
+				if (n >= VT_NPARAM - 1)
+					break;
+				vc->vc_param[n++] = v;
+				v = 0;
+				have = 1;
+			} else
+				break;
+		}
+		if (have)
+			vc->vc_param[n++] = v;
+		vc->vc_nparam = n;
+	}
+	if (*s >= ' ' && *s <= '/')
+		vc->vc_inter = *s++;
+	if (*s < (vc->vc_kind == VK_CSI ? '@' : '0') || *s > '~')
+		return "not an ANSI sequence";
+	vc->vc_final = *s++;
+	*sp = s;
+	return NULL;
+}
+
+/* replacement for one of several sequences in a capability: itself */
+char *vt_rep(struct vtcand *vc)
+{
+	char *rep, *d;
+	int i;
+
+	if (!(rep = d = malloc(8 + 6*VT_NPARAM)))
+		return NULL;
+	*d++ = '\033';
+	if (vc->vc_kind == VK_CSI)
+		*d++ = '[';
+	if (vc->vc_priv)
+		*d++ = vc->vc_priv;
+	for (i = 0; i < vc->vc_nparam; i++)
+		d += sprintf(d, i ? ";%d" : "%d", vc->vc_param[i]);
+	if (vc->vc_inter)
+		*d++ = vc->vc_inter;
+	*d++ = vc->vc_final;
+	*d = '\0';
+	return rep;
+}
+
+/* do a and b match the same sequences? */
+int same_vtcand(struct vtcand *a, struct vtcand *b)
+{
+	return a->vc_kind == b->vc_kind && a->vc_priv == b->vc_priv &&
+	       a->vc_inter == b->vc_inter && a->vc_final == b->vc_final &&
+	       a->vc_nparam == b->vc_nparam &&
+	       memcmp(a->vc_param, b->vc_param,
+		      a->vc_nparam * sizeof *a->vc_param) == 0;
+}
+
+/* add_parse() for the escape sequences of an ANSI-style terminal */
+char *vt_add(struct emu *e, char *cap, char *val, enum action action,
+	     char *rep, int nargs)
+{
+	struct vtcand seq[VT_NSEQ], *vc, **vcp;
+	char *err;
+	int nseq, nfound = 0, rev = 0, inc = 0, i;
+
+	if (strncmp(val, "%i", 2) == 0) {
+		inc = 1;
+		val += 2;
+	}
+	if (val[1] && strchr("]PX^_", val[1]))
+		return "string introducer used as a sequence";
+
+	memset(seq, 0, sizeof seq);
+	seq[0].vc_inc = inc;
+	for (nseq = 0; *val; nseq++) {
+		/* controls like SI in "me" are left to the parse table */
+		while (*val > 0 && *val < ' ' && *val != '\033')
+			val++;
+		if (!*val)
 			break;
+		if (nseq == VT_NSEQ)
+			return "too many sequences";
+		if (err = vt_parse_cap(&val, seq + nseq, &nfound, &rev))
+			return err;
+	}
+	if (rev && action != AC_FMT2)
+		return "%r is not relevant here";
+	if (rev)
+		action = AC_FMT2_REV;
+	if (nfound != nargs)
+		return "incorrect # args";
+
+	/*
+	 * The parts of a capability like "cl" = ESC [ H ESC [ J are each
+	 * dispatched separately and output as they came.
+	 */
+	if (nseq > 1 && nargs)
+		return "several sequences with arguments";
+
+	for (i = 0; i < nseq; i++) {
+		if (!(vc = malloc(sizeof *vc)))
+			return "out of memory";
+		*vc = seq[i];
+		vc->vc_cap[0] = cap[0];
+		vc->vc_cap[1] = cap[1];
+		vc->vc_action = action;
+		vc->vc_rep = rep;
+		if (nseq > 1) {
+			vc->vc_action = AC_FMT;
+			vc->vc_piece = 1;
+			if (!(vc->vc_rep = vt_rep(vc))) {
+				free(vc);
+				return "out of memory";
+			}
+		}
+
+		/*
+		 * If the sequence is already a candidate, keep the first,
+		 * except that a whole capability replaces part of one.
+		 */
+		for (vcp = &e->vt_cands[vc->vc_kind][vc->vc_final - '0']; *vcp;
+		     vcp = &(*vcp)->vc_next) {
+			if (same_vtcand(*vcp, vc))
+				break;
+		}
+		if (!*vcp) {
+			*vcp = vc;
+			continue;
+		}
+		if ((*vcp)->vc_piece && !vc->vc_piece) {
+			vc->vc_next = (*vcp)->vc_next;
+			free((*vcp)->vc_rep);
+			free(*vcp);
+			*vcp = vc;
+			continue;
+		}
+		if (vc->vc_piece)
+			free(vc->vc_rep);
+		free(vc);
+	}
+	return NULL;
+}
+
+/* compile emitters for the candidates, after freeze_pt() */
+int vt_freeze(struct emu *e)
+{
+	struct vtcand *vc;
+	int k, f;
+
+	for (k = 0; k < 2; k++) {
+		for (f = 0; f < 0x7f - 0x30; f++) {
+			for (vc = e->vt_cands[k][f]; vc; vc = vc->vc_next) {
+				if (vc->vc_action > AC_PRINT &&
+				    !(vc->vc_emit = compile_emit(e, vc->vc_rep)))
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+void vt_dump(struct emu *e)
+{
+	struct vtcand *vc;
+	unsigned char *s;
+	int k, f, i;
+
+	for (k = 0; k < 2; k++) {
+		for (f = 0; f < 0x7f - 0x30; f++) {
+			for (vc = e->vt_cands[k][f]; vc; vc = vc->vc_next) {
+				fprintf(stderr, k == VK_CSI ? "CSI " : "ESC ");
+				if (vc->vc_priv)
+					fputc(vc->vc_priv, stderr);
+				for (i = 0; i < vc->vc_nparam; i++) {
+					if (i)
+						fputc(';', stderr);
+					if (vc->vc_param[i] < 0)
+						fprintf(stderr, "%%d");
+					else
+						fprintf(stderr, "%d",
+							vc->vc_param[i]);
+				}
+				if (vc->vc_inter)
+					fputc(vc->vc_inter, stderr);
+				fprintf(stderr, "%c=\"", vc->vc_final);
+				for (s = vc->vc_rep; *s; s++)
+					fprintf(stderr, *s == '\\' ? "\\%c" :
+						*s >= 32 && *s < 127 ? "%c" :
+						"\\%03o", *s);
+				fprintf(stderr, "\" [%2.2s]\r\n", vc->vc_cap);
+			}
+		}
+	}
+}
+
+
+/* does ep start with the first k of steps? */
+int has_steps(struct pentry *ep, struct step *steps, int k)
+{
+	int j;
 
-		    default:  /* AC_FMT*, AC_LL, AC_STLINE */
-			fputc('"', stderr);
-			for (s = pp->pt_ptr; *s; s++)
-				fprintf(stderr, *s == '\\' ? "\\%c" :
-					*s >= 32 && *s < 127 ? "%c" : "\\%03o",
-					*s);
-			fputc('"', stderr);
-			if (pp->pt_action > AC_FMT)
-				fprintf(stderr, ",%c",
-					      " 12RLS"[pp->pt_action - AC_FMT]);
-		}
-		fprintf(stderr, " [%2.2s]\r\n", pp->pt_cap);
+	for (j = 0; j < k; j++) {
+		if (ep->pt_steps[j].pt_inc != steps[j].pt_inc ||
+		    ep->pt_steps[j].pt_initial != steps[j].pt_initial)
+			return 0;
 	}
+	return 1;
 }
 
+/* append an alternative to ep w/k steps, return it or NULL if out of memory */
+struct pentry *add_alt(struct pentry *ep, char *cap, struct step *steps, int k)
+{
+	struct pentry *ap;
+
+	if (!(ap = calloc(1, sizeof *ap)))
+		return NULL;
+	memcpy(ap->pt_steps, steps, k * sizeof *steps);
+	ap->pt_nsteps = k;
+	ap->pt_cap[0] = cap[0];
+	ap->pt_cap[1] = cap[1];
+	ap->pt_action = AC_NEXT;
+	while (ep->pt_alt)
+		ep = ep->pt_alt;
+	ep->pt_alt = ap;
+	return ap;
+}
 
-char *add_parse(char *cap, char *val, enum action action, char *rep)
+/*
+ * Add a capability to the parsetab tree.  Where it conflicts with one
+ * already added, it goes in an alternative of the entry where they
+ * diverge, unless both are the same sequence.
+ */
+char *add_parse(struct emu *e, char *cap, char *val, enum action action,
+		char *rep)
 {
 	static char msg[128];
-	struct pentry *pt = parsetab, *ep = NULL;
-	struct step *step;
+	struct pentry *pt = e->parsetab, *ep = NULL, *ap, *np;
+	struct step steps[2], step;  /* argument steps since ep */
+	int k = 0;		    /* # steps since ep */
 	int nargs = 0;		    /* required # args */
 	int nfound = 0;		    /* total # '%' formats */
 	int incr = 0;		    /* '%i' present */
@@ -265,7 +1385,8 @@ char *add_parse(char *cap, char *val, enum action action, char *rep)
 			fprintf(stderr,
 				*s >= 32 && *s < 127 ? "%c" : "\\%03o", *s);
 		fprintf(stderr, "\r\n");
-		dump_pt(parsetab, 2);
+		if (!freeze_pt(e))
+			dump_pt(e, 0, 2);
 	}
 
 	/* ignore capabilities with empty values (typically 'im', 'ei') */
@@ -287,6 +1408,10 @@ char *add_parse(char *cap, char *val, enum action action, char *rep)
 		nargs = action - AC_FMT;
 		break;
 
+	    case AC_REGION:
+		nargs = 2;
+		break;
+
 	    case AC_LL:
 		break;
 
@@ -302,6 +1427,20 @@ char *add_parse(char *cap, char *val, enum action action, char *rep)
 		return "internal error: action";
 	}
 
+	/*
+	 * ANSI-style: escape sequences are dispatched by xlate_vt().  It
+	 * ignores unknown sequences anyway, and consumes strings like the
+	 * title after "ts" without output.
+	 */
+	if (e->term_vt) {
+		if (action == AC_STLINE || rep && !*rep)
+			return NULL;
+		if (val[0] == '\033' || strncmp(val, "%i\033", 3) == 0)
+			return vt_add(e, cap, val, action, rep, nargs);
+		if (val[1])
+			return "not an ANSI sequence";
+	}
+
 	while (c = *val++) {
 		if (c == u'\200')	/* embedded NUL in control seq. */
 			c = 0;
@@ -313,38 +1452,59 @@ char *add_parse(char *cap, char *val, enum action action, char *rep)
 			if (c == '%')		/* advance past "%%" */
 				val++;
 
-			if (!pt) {
-				pt = calloc(128, sizeof(struct pentry));
-				if (!pt)
+			if (ep) {
+				/* find an alternative that continues here */
+				for (ap = ep; ap; ap = ap->pt_alt) {
+					if (ap->pt_action == AC_NEXT &&
+					    ap->pt_nsteps == k &&
+					    has_steps(ap, steps, k))
+						break;
+				}
+
+				/* else one that accepts, moved to the end */
+				for (np = ep; !ap && np; np = np->pt_alt) {
+					if (np->pt_action <= AC_NEXT ||
+					    np->pt_nsteps != k ||
+					    !has_steps(np, steps, k))
+						continue;
+					if (!(ap = add_alt(ep, np->pt_cap,
+							   steps, k)))
+						return "out of memory";
+					ap->pt_action = np->pt_action;
+					ap->pt_ptr = np->pt_ptr;
+					ap = np;
+					ap->pt_action = AC_NEXT;
+					ap->pt_ptr = NULL;
+				}
+
+				if (!ap && !(ap = add_alt(ep, cap, steps, k)))
 					return "out of memory";
-				ep->pt_cap[0] = cap[0];
-				ep->pt_cap[1] = cap[1];
-				ep->pt_ptr = pt;
-				if (ep->pt_nsteps < 2)
-					ep->pt_steps[ep->pt_nsteps].pt_initial
+				if (!ap->pt_ptr) {
+					pt = calloc(128, sizeof(struct pentry));
+					if (!pt)
+						return "out of memory";
+					ap->pt_cap[0] = cap[0];
+					ap->pt_cap[1] = cap[1];
+					ap->pt_ptr = pt;
+					if (k < 2)
+						ap->pt_steps[k].pt_initial
 								     = ST_NEXT;
+				}
+				pt = ap->pt_ptr;
 			}
 
 			ep = pt + c;
-			if (ep->pt_action > AC_NEXT &&
-			    (ep->pt_action != action || ep->pt_ptr != rep)) {
-				sprintf(msg, "conflict with '%2.2s' capability",
-					     ep->pt_cap);;
-				return msg;
-			}
-			pt = ep->pt_ptr;
-			ep->pt_action = AC_NEXT;
+			k = 0;
+			if (ep->pt_action == AC_IGNORE)
+				ep->pt_action = AC_NEXT;    /* in progress */
 			continue;
 		}
 
 		if (!ep)
 			return "first character is an argument";
-		step = ep->pt_steps + ep->pt_nsteps;
-		if (step->pt_initial) {
-			sprintf(msg, "conflict with '%2.2s' capability",
-				     ep->pt_cap);
-			return msg;
-		}
+		if (k >= 2)
+			return "too many arguments";
+		memset(&step, 0, sizeof step);
 		switch (c = *val++) {
 		    case '\0':
 			return "% at end of value";
@@ -352,27 +1512,28 @@ char *add_parse(char *cap, char *val, enum action action, char *rep)
 		    case '+':
 			if (!(c = *val++))
 				return "%+ at end of value";
-			step->pt_inc = c;
-			step->pt_initial = ST_GET_1C;
+			step.pt_inc = c;
+			step.pt_initial = ST_GET_1C;
 			break;
 
 		    case '.':
-			step->pt_initial = ST_GET_1C;
+			step.pt_initial = ST_GET_1C;
 			break;
 
 		    case '2':
-			step->pt_initial = ST_GET_2D;
+			step.pt_initial = ST_GET_2D;
 			break;
 
 		    case '3':
-			step->pt_initial = ST_GET_3D;
+			step.pt_initial = ST_GET_3D;
 			break;
 
 		    case 'd':
-			if (!*val || *val >= '0' && *val <= '9'
-				  || *val == '%' && val[1] != '%')
+			/* at the end, the next sequence's first char ends it */
+			if (*val >= '0' && *val <= '9'
+			    || *val == '%' && val[1] != '%')
 				return "%d must be followed by non-digit";
-			step->pt_initial = ST_GET_DIGITS;
+			step.pt_initial = ST_GET_DIGITS;
 			break;
 
 		    case 'i':
@@ -393,30 +1554,158 @@ char *add_parse(char *cap, char *val, enum action action, char *rep)
 
 		if (++nfound > nargs)
 			return "too many arguments";
-		step->pt_inc += incr;
-		ep->pt_nsteps++;
+		step.pt_inc += incr;
+		steps[k++] = step;
+
+		/* share the step with an alternative, or add it to ours */
+		for (ap = ep; ap; ap = ap->pt_alt) {
+			if (ap->pt_nsteps >= k && has_steps(ap, steps, k))
+				break;
+		}
+		if (ap)
+			continue;
+		for (ap = ep; ap; ap = ap->pt_alt) {
+			if (ap->pt_action == AC_NEXT && !ap->pt_ptr &&
+			    ap->pt_nsteps == k-1 && has_steps(ap, steps, k-1))
+				break;
+		}
+		if (!ap && !(ap = add_alt(ep, cap, steps, k-1)))
+			return "out of memory";
+		ap->pt_steps[k-1] = step;
+		ap->pt_nsteps = k;
 	}
 
 	if (action != AC_STLINE && nfound != nargs)
 		return "incorrect # args";
-	if (ep->pt_action != AC_NEXT) {
-		if (debug) {
-			fprintf(stderr, "internal error: next");
-			abort();
+
+	/* only the same sequence for something else is a conflict */
+	for (ap = ep; ap; ap = ap->pt_alt) {
+		if (ap->pt_nsteps != k || !has_steps(ap, steps, k))
+			continue;
+		if (ap->pt_action == AC_NEXT && !ap->pt_ptr ||
+		    ap->pt_action == action && ap->pt_ptr == rep)
+			break;			/* in progress, or already */
+		if (ap->pt_action > AC_NEXT) {
+			sprintf(msg, "conflict with '%2.2s' capability",
+				     ap->pt_cap);
+			return msg;
 		}
-		return "internal error: next";
 	}
-	if (!ep->pt_cap[0]) {
-		ep->pt_cap[0] = cap[0];
-		ep->pt_cap[1] = cap[1];
+	if (!ap && !(ap = add_alt(ep, cap, steps, k)))
+		return "out of memory";
+	if (!ap->pt_cap[0]) {
+		ap->pt_cap[0] = cap[0];
+		ap->pt_cap[1] = cap[1];
 	}
-	ep->pt_action = action;
-	ep->pt_ptr = rep;
+	ap->pt_action = action;
+	ap->pt_ptr = rep;
 
 	return NULL;
 }
 
 
+/*
+ * Most output is runs of characters that are printed as-is at the root of
+ * the parse table.  Find the longest range of such characters, e->print_lo
+ * to e->print_hi, and use a vectorized scan to copy runs of them (after
+ * stripping parity) directly into e->obuf.  Each scan function returns
+ * the length of the run at s, copied to d.
+ */
+int scan_print_c(struct emu *e, unsigned char *s, int n, char *d)
+{
+	unsigned char c, lo = e->print_lo, hi = e->print_hi;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		c = s[i] & 0x7f;
+		if (c < lo || c > hi)
+			break;
+		d[i] = c;
+	}
+	return i;
+}
+
+#ifdef __SSE2__
+int scan_print_sse2(struct emu *e, unsigned char *s, int n, char *d)
+{
+	__m128i strip = _mm_set1_epi8(0x7f);
+	__m128i lo = _mm_set1_epi8(e->print_lo - 1);
+	__m128i hi = _mm_set1_epi8(e->print_hi + 1);
+	__m128i v;
+	unsigned mask;
+	int i;
+
+	/* print_hi < 127, so signed compares are safe */
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_and_si128(_mm_loadu_si128((__m128i *)(s+i)), strip);
+		_mm_storeu_si128((__m128i *)(d+i), v);
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo),
+						       _mm_cmpgt_epi8(hi, v)));
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + scan_print_c(e, s+i, n-i, d+i);
+}
+
+__attribute__((target("avx2")))
+int scan_print_avx2(struct emu *e, unsigned char *s, int n, char *d)
+{
+	__m256i strip = _mm256_set1_epi8(0x7f);
+	__m256i lo = _mm256_set1_epi8(e->print_lo - 1);
+	__m256i hi = _mm256_set1_epi8(e->print_hi + 1);
+	__m256i v;
+	unsigned mask;
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_and_si256(_mm256_loadu_si256((__m256i *)(s+i)),
+				     strip);
+		_mm256_storeu_si256((__m256i *)(d+i), v);
+		mask = _mm256_movemask_epi8(
+				_mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+						 _mm256_cmpgt_epi8(hi, v)));
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + scan_print_sse2(e, s+i, n-i, d+i);
+}
+#endif
+
+void init_scan_print(struct emu *e)
+{
+	int c, lo, best_lo = 1, best_hi = 0;
+
+	/* find longest range of printable chars w/no argument steps */
+	for (c = lo = 32; c <= 127; c++) {
+		if (c < 127 && PENTRY(e, 0, c)->pt_action == AC_PRINT &&
+			       PENTRY(e, 0, c)->pt_nsteps == 0 &&
+			       !PENTRY(e, 0, c)->pt_alt)
+			continue;
+		if (c - 1 - lo > best_hi - best_lo) {
+			best_lo = lo;
+			best_hi = c - 1;
+		}
+		lo = c + 1;
+	}
+	e->print_lo = best_lo;
+	e->print_hi = best_hi;
+
+	/* tracing needs to see every character */
+	e->scan_print = NULL;
+	if (debug > 2 || e->print_lo > e->print_hi)
+		return;
+#ifdef __SSE2__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		e->scan_print = scan_print_avx2;
+	else
+		e->scan_print = scan_print_sse2;
+#else
+	e->scan_print = scan_print_c;
+#endif
+}
+
+
 /* validate terminal type and initialize parse table */
 #define E(x) x, "»" x
 #define N(x) x, x
@@ -435,7 +1724,7 @@ struct tcap {
 	"cl", AC_FMT,    N(ANSI_CLEAR),
 	"cm", AC_FMT2,   N("\e[%d;%dH"),/* ANSI position cursor */
 	"cr", AC_FMT,    N("\r"),	/* ^M */
-	"cs", AC_IGNORE, N(NULL),	/* unsupported */
+	"cs", AC_REGION, N("\e[%d;%dr"),/* DEC set scrolling region */
 	"dc", AC_FMT,    N("\e[P"),	/* ANSI delete character */
 	"dl", AC_FMT,    N("\e[M"),	/* ANSI delete line */
 	"do", AC_FMT,    N("\n"),	/* ^J */
@@ -465,19 +1754,35 @@ struct tcap {
 	"vs", AC_FMT,    N(""),		/* ignore */
 	"",   0,         N(NULL)
 };
+
+/* optional: without one that doesn't fit, curses falls back to others */
+struct tcap ocaps[] = {
+	"sr", AC_FMT,    N("\eM"),	/* ANSI reverse index */
+	"AL", AC_FMT1,   N("\e[%dL"),	/* ANSI insert lines */
+	"DC", AC_FMT1,   N("\e[%dP"),	/* ANSI delete characters */
+	"DL", AC_FMT1,   N("\e[%dM"),	/* ANSI delete lines */
+	"DO", AC_FMT1,   N("\e[%dB"),	/* ANSI down */
+	"IC", AC_FMT1,   N("\e[%d@"),	/* ANSI insert characters */
+	"LE", AC_FMT1,   N("\e[%dD"),	/* ANSI left */
+	"RI", AC_FMT1,   N("\e[%dC"),	/* ANSI right */
+	"UP", AC_FMT1,   N("\e[%dA"),	/* ANSI up */
+	"",   0,         N(NULL)
+};
 #undef E
 #undef N
 #undef S
 
 
-/* returns capability value after skipping over padding */
-char *get_strcap(char *cap)
+/*
+ * Returns capability value after skipping over padding.  The termcap
+ * library reads the entry last loaded, so only while e's terminal type is
+ * being set.
+ */
+char *get_strcap(struct emu *e, char *cap)
 {
-	static char cbuf[2048];	/* extracted capability values */
-	static char *cp = cbuf;
 	char *rv;
 
-	if (!(rv = tgetstr(cap, &cp)) || *rv < '0' || *rv > '9')
+	if (!(rv = tgetstr(cap, &e->cbp)) || *rv < '0' || *rv > '9')
 		return rv;
 	while (*rv >= '0' && *rv <= '9')
 		rv++;
@@ -491,15 +1796,15 @@ char *get_strcap(char *cap)
 }
 
 
-/* returns "cm" to row 0 col 0 without using "up" or "le" capabilities */
-char *tgoto_home(void)
+/* returns "cm" fmt to row, col without using "up" or "le" capabilities */
+char *tgoto_cm(char *fmt, unsigned row, unsigned col)
 {
 	static char buf[64];
-	char *fmt, *s = buf;
-	unsigned tmp, a1 = 0, a2 = 0;
+	char *s = buf;
+	unsigned tmp, a1 = row, a2 = col;
 	char c;
 
-	if (!(fmt = get_strcap("cm")))		/* no "cm"? */
+	if (!fmt)				/* no "cm"? */
 		return NULL;
 
 	while (c = *fmt++) {
@@ -556,41 +1861,58 @@ char *tgoto_home(void)
 }
 
 
-char *set_termtype(char *term, struct winsize *ws, char *errbuf)
+char *set_termtype(struct emu *e, char *term, struct winsize *ws,
+		   char *errbuf)
 {
-	static char tbuf[2048];	/* returned termcap entry */
 	char *cp, *err, *s;
 	struct tcap *tp;
+	struct pentry *save;
+	struct xlate *xp;
+	unsigned long long sig;
 	int c, has_sg, rv;
 
-	rv = tgetent(tbuf, term);
+	/* start over, in case of a previous terminal type */
+	free_xlate(e);
+	memset(&e->vt, 0, sizeof e->vt);
+	e->term_hz = 0;
+	for (c = 0; c < 4; c++)
+		e->term_arrows[c] = "";
+	e->cbp = e->cbuf;
+	if (!(e->parsetab = calloc(128, sizeof *e->parsetab)))
+		return "out of memory";
+
+	rv = tgetent(e->tbuf, term);
 	if (rv < 0)
 		return "No termcap file found, try setting TERMPATH";
 	if (rv == 0)
 		return "Terminal type not found in termcap database";
 
-	parsetab['\n'].pt_action = AC_PRINT;
-	parsetab['\r'].pt_action = AC_PRINT;
+	e->parsetab['\n'].pt_action = AC_PRINT;
+	e->parsetab['\r'].pt_action = AC_PRINT;
 	for (c = 32; c < 127; c++)	/* initialize printable chars */
-		parsetab[c].pt_action = AC_PRINT;
+		e->parsetab[c].pt_action = AC_PRINT;
+
+	/* ANSI-style? */
+	cp = get_strcap(e, "cm");
+	e->term_vt = cp && cp[0] == '\033' && cp[1] == '[';
 
 	/* Boolean capabilities */
-	term_am = tgetflag("am");
+	e->term_am = tgetflag("am");
 	if (tgetflag("bs")) {
-		struct pentry *pp = parsetab + '\b';
+		struct pentry *pp = e->parsetab + '\b';
 
 		pp->pt_action = AC_PRINT;
 		pp->pt_cap[0] = 'b';
 		pp->pt_cap[1] = 's';
 	}
 	if (tgetflag("hz")) {
-		parsetab['~'].pt_action = AC_IGNORE;
-		term_hz = 1;
+		e->parsetab['~'].pt_action = AC_IGNORE;
+		e->term_hz = 1;
 	}
 	if (tgetflag("os"))
 		return "Termcap 'os' capability is unsupported";
 	if (tgetflag("pt")) {
-		struct pentry *pp = parsetab + '\t';
+		struct pentry *pp = e->parsetab + '\t';
 
 		pp->pt_action = AC_PRINT;
 		pp->pt_cap[0] = 'p';
@@ -599,13 +1921,13 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 	if (tgetflag("x7")) {			/* CDC 713 glitch */
 		struct pentry *pp;
 
-		pp = parsetab + '\003';		/* ETX */
+		pp = e->parsetab + '\003';		/* ETX */
 		pp->pt_action = AC_FMT;
 		pp->pt_cap[0] = 'x';
 		pp->pt_cap[1] = '7';
 		pp->pt_ptr = "▲";
 
-		pp = parsetab + '\177';		/* DEL */
+		pp = e->parsetab + '\177';		/* DEL */
 		pp->pt_action = AC_FMT;
 		pp->pt_cap[0] = 'x';
 		pp->pt_cap[1] = '7';
@@ -613,14 +1935,14 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 	}
 
 	/* numeric capabilities */
-	term_cols = tgetnum("co");
-	term_lines = tgetnum("li");
-	if (term_cols <= 0)
+	e->term_cols = tgetnum("co");
+	e->term_lines = tgetnum("li");
+	if (e->term_cols <= 0)
 		return "Columns not valid in termcap entry";
-	if (term_lines <= 0)	/* not set, use current screen size */
-		term_lines = ws->ws_row;
-	ws->ws_row = term_lines;
-	ws->ws_col = term_cols;
+	if (e->term_lines <= 0)	/* not set, use current screen size */
+		e->term_lines = ws->ws_row;
+	ws->ws_row = e->term_lines;
+	ws->ws_col = e->term_cols;
 	has_sg = tgetnum("sg");
 	if (has_sg > 1)
 		return "Termcap 'sg' capability > 1 is unsupported";
@@ -631,7 +1953,7 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 
 	/* string capabilities */
 	for (tp = tcaps; tp->tc_name[0]; tp++) {
-		if (!(cp = get_strcap(tp->tc_name)))
+		if (!(cp = get_strcap(e, tp->tc_name)))
 			continue;
 		if (!tp->tc_rep[has_sg]) {
 			sprintf(errbuf,
@@ -639,7 +1961,7 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 				tp->tc_name);
 			return errbuf;
 		}
-		err = add_parse(tp->tc_name, cp, tp->tc_action,
+		err = add_parse(e, tp->tc_name, cp, tp->tc_action,
 				tp->tc_rep[has_sg]);
 		if (err) {
 			sprintf(errbuf,
@@ -650,9 +1972,10 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 	}
 
 	/* if "ho" differs from "cm" to (0,0), add it */
-	if (cp = get_strcap("ho")) {
-		if (!(s = tgoto_home()) || strcmp(cp, s) != 0) {
-			if (err = add_parse("ho", cp, AC_FMT, ANSI_HOME)) {
+	if (cp = get_strcap(e, "ho")) {
+		s = tgoto_cm(get_strcap(e, "cm"), 0, 0);
+		if (!s || strcmp(cp, s) != 0) {
+			if (err = add_parse(e, "ho", cp, AC_FMT, ANSI_HOME)) {
 				sprintf(errbuf, "Termcap 'ho' capability "
 						"unsupported: %s", err);
 				return errbuf;
@@ -661,10 +1984,10 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 	}
 
 	/* if "le" differs from "bs" and "bc", add it */
-	if (cp = get_strcap("le")) {
+	if (cp = get_strcap(e, "le")) {
 		if ((!tgetflag("bs") || strcmp(cp, "\b") != 0) &&
-		    (!(s = get_strcap("bc")) || strcmp(cp, s) != 0)) {
-			if (err = add_parse("le", cp, AC_FMT, ANSI_LEFT)) {
+		    (!(s = get_strcap(e, "bc")) || strcmp(cp, s) != 0)) {
+			if (err = add_parse(e, "le", cp, AC_FMT, ANSI_LEFT)) {
 				sprintf(errbuf, "Termcap 'le' capability "
 						"unsupported: %s", err);
 				return errbuf;
@@ -673,10 +1996,10 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 	}
 
 	/* if "sf" differs from "do" and newline, add it */
-	if (cp = get_strcap("sf")) {
+	if (cp = get_strcap(e, "sf")) {
 		if (strcmp(cp, "\n") != 0 &&
-		    (!(s = get_strcap("do")) || strcmp(cp, s) != 0)) {
-			if (err = add_parse("sf", cp, AC_FMT, ANSI_SCROLL_UP)) {
+		    (!(s = get_strcap(e, "do")) || strcmp(cp, s) != 0)) {
+			if (err = add_parse(e, "sf", cp, AC_FMT, ANSI_SCROLL_UP)) {
 				sprintf(errbuf, "Termcap 'sf' capability "
 						"unsupported: %s", err);
 				return errbuf;
@@ -685,10 +2008,10 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 	}
 
 	/* if "md" differs from "mr", add it */
-	if (cp = get_strcap("md")) {
-		if (!(s = get_strcap("mr")) || strcmp(cp, s) != 0) {
+	if (cp = get_strcap(e, "md")) {
+		if (!(s = get_strcap(e, "mr")) || strcmp(cp, s) != 0) {
 			s = has_sg ? ANSI_BOLD "«" : ANSI_BOLD;
-			if (err = add_parse("md", cp, AC_FMT, s)) {
+			if (err = add_parse(e, "md", cp, AC_FMT, s)) {
 				sprintf(errbuf, "Termcap 'md' capability "
 						"unsupported: %s", err);
 				return errbuf;
@@ -697,12 +2020,12 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 	}
 
 	/* if "so" differs from "md", "mr", and "us", add it */
-	if (cp = get_strcap("so")) {
-		if ((!(s = get_strcap("md")) || strcmp(cp, s) != 0) &&
-		    (!(s = get_strcap("mr")) || strcmp(cp, s) != 0) &&
-		    (!(s = get_strcap("us")) || strcmp(cp, s) != 0)) {
+	if (cp = get_strcap(e, "so")) {
+		if ((!(s = get_strcap(e, "md")) || strcmp(cp, s) != 0) &&
+		    (!(s = get_strcap(e, "mr")) || strcmp(cp, s) != 0) &&
+		    (!(s = get_strcap(e, "us")) || strcmp(cp, s) != 0)) {
 			s = has_sg ? ANSI_INVERSE "«" : ANSI_INVERSE;
-			if (err = add_parse("so", cp, AC_FMT, s)) {
+			if (err = add_parse(e, "so", cp, AC_FMT, s)) {
 				sprintf(errbuf, "Termcap 'so' capability "
 						"unsupported: %s", err);
 				return errbuf;
@@ -710,21 +2033,76 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 		}
 	}
 
+	/* optional capabilities, undone if they don't fit */
+	for (tp = ocaps; tp->tc_name[0]; tp++) {
+		if (!(cp = get_strcap(e, tp->tc_name)))
+			continue;
+		if (!(save = copy_pt(e->parsetab)))
+			return "out of memory";
+		err = add_parse(e, tp->tc_name, cp, tp->tc_action,
+				tp->tc_rep[has_sg]);
+		if (err) {
+			if (debug)
+				fprintf(stderr, "Termcap '%s' capability "
+						"ignored: %s\n",
+					tp->tc_name, err);
+			free_pt(e->parsetab);
+			memcpy(e->parsetab, save, 128 * sizeof *save);
+		} else
+			free_pt(save);
+		free(save);
+	}
+
 	/* arrow keys */
 	for (c = 0; c < 4; c++) {
-		if (cp = get_strcap(arrow_caps + c*2))
-			term_arrows[c] = cp;
+		if (cp = get_strcap(e, arrow_caps + c*2))
+			e->term_arrows[c] = cp;
 	}
 
 	/* all done */
-	term_set = 1;
+	if (cp = freeze_pt(e))
+		return cp;
+	if (e->term_vt && vt_freeze(e) < 0)
+		return "out of memory";
+	free_pt(e->parsetab);
+	free(e->parsetab);
+	e->parsetab = NULL;
+	init_scan_print(e);
+	e->term_cs = get_strcap(e, "cs") != NULL;
+	e->term_im = get_strcap(e, "im") != NULL;
+	e->term_set = 1;
+
+	/*
+	 * Use a specialized translator if one was generated for this table,
+	 * unless tracing.
+	 */
+	e->xlate = e->term_vt ? xlate_vt : xlate_generic;
+	xp = NULL;
+	if (debug > 2) {
+		if (!tring && !(tring = calloc(TRACE_SIZE, sizeof *tring)))
+			return "out of memory";
+		e->xlate = e->term_vt ? xlate_vt_traced : xlate_traced;
+	} else if (!e->term_vt) {
+		sig = pt_sig(e);
+		for (xp = xlates; xp->xl_name; xp++) {
+			if (xp->xl_sig == sig) {
+				e->xlate = xp->xl_fn;
+				break;
+			}
+		}
+	}
 	if (debug) {
+		if (xp && xp->xl_name)
+			fprintf(stderr, "using translator for %s\n",
+				xp->xl_name);
 		if (debug > 1)
 			fprintf(stderr, "parsetab:\n");
-		dump_pt(parsetab, 0);
+		dump_pt(e, 0, 0);
+		if (e->term_vt)
+			vt_dump(e);
 		for (c = 0; c < 4; c++) {
 			fprintf(stderr, "%2.2s=\"", arrow_caps + c*2);
-			for (s = term_arrows[c]; *s; s++)
+			for (s = e->term_arrows[c]; *s; s++)
 				fprintf(stderr, *s == '\\' ? "\\%c" :
 					*s >= 32 && *s < 127 ? "%c" : "\\%03o",
 					*s);
@@ -735,43 +2113,158 @@ char *set_termtype(char *term, struct winsize *ws, char *errbuf)
 }
 
 
-/* read output from slave pty, write to user */
-int handle_output(int mfd)
+/* no terminal type: pass output through as-is */
+int xlate_none(struct emu *e, unsigned char *buf, int n)
 {
-	static struct pentry *pt = parsetab;
-	static struct pentry *pp = NULL;
-	static int nump = 0, p[2] = { 0, 0 };
-	static char prevc = -1;
-	static enum action prev_action = -1;
-	static enum state state;
-	static int step;
-	int i, t, rc, rv = 0;
-	char c, buf[128];
-
-	if ((rc = read(mfd, buf, sizeof buf)) <= 0)
-		return rc;
-	if (savefd >= 0)
-		write(savefd, buf, rc);
+	return out_write(e, (char *)buf, n);
+}
+
+/*
+ * With -ddd, the translation of each byte is recorded in a ring, cheaply
+ * enough to trace real workloads.  ~t or SIGUSR1 writes it to a file.
+ */
+struct trace *tring = NULL;
+unsigned tnext = 0;
+
+static inline void add_trace(long long ns, char c, enum action action,
+			     char *cap, int *p)
+{
+	struct trace *tr = tring + (tnext++ & (TRACE_SIZE-1));
+
+	tr->tr_ns = ns;
+	tr->tr_c = c;
+	tr->tr_action = action;
+	tr->tr_cap[0] = cap[0];
+	tr->tr_cap[1] = cap[1];
+	tr->tr_arg[0] = p[0];
+	tr->tr_arg[1] = p[1];
+}
+
+/* write the trace ring to path, oldest first; return # records or -1 */
+int dump_trace(char *path)
+{
+	unsigned n, first, len;
+	int fd, rv;
+
+	if (!tring) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0)
+		return -1;
+	n = MIN(tnext, TRACE_SIZE);
+	first = (tnext - n) & (TRACE_SIZE-1);
+	len = MIN(n, TRACE_SIZE - first);
+	rv = write_all(fd, TRACE_MAGIC, sizeof TRACE_MAGIC - 1);
+	if (rv >= 0)
+		rv = write_all(fd, (char *)(tring + first), len * sizeof *tring);
+	if (rv >= 0)
+		rv = write_all(fd, (char *)tring, (n - len) * sizeof *tring);
+	close(fd);
+	return rv < 0 ? rv : n;
+}
+
+/* ~t command */
+void save_trace(char *path)
+{
+	int n;
+
+	if (path[0] == ' ')	/* skip optional space after "~t" */
+		path++;
+	if (!path[0])
+		path = TRACE_FILE;
+	if (!tring)
+		out_msg("Not tracing, use -ddd\r\n");
+	else if ((n = dump_trace(path)) < 0)
+		out_msg("%s: %s\r\n", path, strerror(errno));
+	else
+		out_msg("Traced %d bytes to '%s'\r\n", n, path);
+}
+
+/*
+ * Interpret the frozen parse table.  This is instantiated with and
+ * without tracing, so the untraced loop doesn't test for it.
+ *
+ * Selecting an entry with an alternative remembers where, and records
+ * the characters that follow (up to PEND_MAX).  If they then don't match,
+ * the alternative is selected instead and they are replayed.
+ *
+ * Between calls, the state is kept in e->pts; the scalars are worked on
+ * in locals, and saved around the recursive call that replays.
+ */
+
+#define TRACE(action) \
+	do { if (traced) add_trace(ns, c, action, pp->pt_cap, p); } while (0)
+
+#define PT_LOAD() \
+	do { st = ps->st; pp = ps->pp; nump = ps->nump; state = ps->state; \
+	     step = ps->step; bt = ps->bt; alt = ps->alt; bt_st = ps->bt_st; \
+	     bt_nump = ps->bt_nump; npend = ps->npend; bt_c = ps->bt_c; } while (0)
+#define PT_SAVE() \
+	do { ps->st = st; ps->pp = pp; ps->nump = nump; ps->state = state; \
+	     ps->step = step; ps->bt = bt; ps->alt = alt; ps->bt_st = bt_st; \
+	     ps->bt_nump = bt_nump; ps->npend = npend; ps->bt_c = bt_c; } while (0)
+
+static inline __attribute__((always_inline))
+int xlate_pt(struct emu *e, unsigned char *buf, int rc, const int traced)
+{
+	struct ptstate *ps = &e->pts;
+	int (*scan)(struct emu *, unsigned char *, int, char *) = e->scan_print;
+	int st, nump, step, bt_st, bt_nump, npend;
+	int *p = ps->p, *bt_p = ps->bt_p;
+	struct pentry *pp, *bt, *alt;
+	enum state state;
+	unsigned char bt_c, *pend = ps->pend;
+	unsigned char rbuf[PEND_MAX+1];
+	long long ns = traced ? mono_ns() : 0;
+	int i, n, t, rv = 0, again = 0;
+	char c;
+
+	PT_LOAD();
 	for (i = 0; i < rc; i++) {
-		if (odelay.tv_nsec)
-			(void) nanosleep(&odelay, NULL);
-		if (!term_set) {
-			if ((rv = write(STDOUT_FILENO, buf+i, 1)) < 0)
+		/* at the root, copy a run of printable chars in bulk */
+		if (!traced && scan && st == 0 && !pp) {
+			if (e->olen + rc-i > sizeof e->obuf &&
+			    (rv = flush_output(e)) < 0)
+				break;
+			n = (*scan)(e, buf+i, MIN(rc-i, sizeof e->obuf - e->olen),
+				    e->obuf + e->olen);
+			e->olen += n;
+			if ((i += n) == rc)
 				break;
-			continue;
 		}
-		if (debug > 2 && prevc >= 0)
-			fprintf(stderr, prevc == '\\' ? "\\%c" :
-			   prevc > 32 && prevc < 127 ? "%c" : "\\%03o", prevc);
-		prevc = c = buf[i] & 0x7f;	/* strip parity bit */
+
+		c = buf[i] & 0x7f;	/* strip parity bit */
+		if (bt) {
+			if (npend < PEND_MAX)
+				pend[npend++] = c;
+			else
+				bt = NULL;	/* too far to replay */
+		}
 
 next_level:
 		if (!pp) {
-			pp = pt + c;
+			if (!alt)
+				pp = PENTRY(e, st, c);
+			else {
+				pp = alt;	/* backtracking */
+				alt = NULL;
+			}
+			if (pp->pt_alt) {
+				bt = pp->pt_alt;
+				bt_st = st;
+				bt_c = c;
+				bt_nump = nump;
+				bt_p[0] = p[0];
+				bt_p[1] = p[1];
+				npend = 0;
+			}
 			step = 0;
 			state = pp->pt_steps[0].pt_initial;
-			if (pp->pt_nsteps > 0)
+			if (pp->pt_nsteps > 0) {
+				TRACE(AC_NEXT);
 				continue;    /* to next char & start steps */
+			}
 			/* else, fall through to do action for this char */
 		}
 
@@ -781,7 +2274,7 @@ next_level:
 
 			if (nump >= 2) {
 				fprintf(stderr, "\r\ninternal error: params\r\n");
-				dump_pt(pt, 0);
+				dump_pt(e, st, 0);
 				if (debug)
 					abort();
 				return -1;
@@ -790,7 +2283,7 @@ next_level:
 			    case ST_UNSET:
 			    case ST_NEXT:
 				fprintf(stderr, "\r\ninternal error: state\r\n");
-				dump_pt(pt, 0);
+				dump_pt(e, st, 0);
 				if (debug)
 					abort();
 				return -1;
@@ -799,6 +2292,7 @@ next_level:
 				if (v < 0 || v > 9)
 					break;	/* end of step */
 				p[nump] = p[nump]*10 + v;
+				TRACE(AC_NEXT);
 				continue;	/* to process next char */
 
 			    case ST_GET_1C:
@@ -811,6 +2305,7 @@ next_level:
 					v = 0;
 				p[nump] = p[nump]*10 + v;
 				state++;
+				TRACE(AC_NEXT);
 				continue;	/* to process next char */
 
 			    case ST_GET_1D:
@@ -828,89 +2323,75 @@ next_level:
 			/* if more steps, start it */
 			if (++step < pp->pt_nsteps) {
 				state = pp->pt_steps[step].pt_initial;
+				TRACE(AC_NEXT);
 				continue;
 			}
 
 			/*
 			 * %d ends after reading a non-digit that follows.
 			 * That non-digit can't be un-read, so proceed
-			 * immediately to the parse table for that character.
+			 * immediately to the parse table for that character,
+			 * or if %d ends the sequence, do its action and then
+			 * start the next one with it.
 			 */
 			if (state == ST_GET_DIGITS) {
-				if (pp->pt_action != AC_NEXT) {
-					/* add_parse should have ensured this */
-					fprintf(stderr, "\r\ninternal error: "
-							"%%d\r\n");
-					dump_pt(pt, 0);
-					if (debug)
-						abort();
-					return -1;
+				if (pp->pt_action != AC_NEXT)
+					again = 1;
+				else {
+					st = pp->pt_next;
+					pp = NULL;
+					goto next_level;
 				}
-				pt = pp->pt_ptr;
-				pp = NULL;
-				goto next_level;
 			}
 
 			/* fall through to do action */
 		}
 
-		/* log the action for this character sequence */
-		if (debug > 2) {
-			/* log contiguous PRINT actions in a single group */
-			if (prev_action == AC_PRINT &&
-			    pp->pt_action != prev_action)
-				fprintf(stderr, " PRT\r\n");
-			if (pp->pt_action == AC_PRINT)
-				goto log_end;
-
-			fprintf(stderr, c == '\\' ? "\\%c" :
-				c > 32 && c < 127 ? "%c" : "\\%03o", c);
-			prevc = -1;
-			if (pp->pt_action == AC_NEXT)
-				goto log_end;
-
-			fprintf(stderr, " [%2.2s] ", pp->pt_cap);
-			switch (pp->pt_action) {
-			    case AC_IGNORE:   fprintf(stderr, "IGN\r\n"); break;
-			    case AC_FMT:      fprintf(stderr, "FMT\r\n"); break;
-			    case AC_FMT1:     fprintf(stderr, "FM1\r\n"); break;
-			    case AC_FMT2:     fprintf(stderr, "FM2\r\n"); break;
-			    case AC_FMT2_REV: fprintf(stderr, "F2R\r\n"); break;
-			    case AC_LL:	      fprintf(stderr, "LL \r\n"); break;
-			    case AC_STLINE:   fprintf(stderr, "STL\r\n"); break;
-			    default:	      fprintf(stderr, "?%d?\r\n",
-							      pp->pt_action);
-			}
-
-log_end:
-			prev_action = pp->pt_action;
-		}
+		TRACE(pp->pt_action);
 
-#pragma GCC diagnostic ignored "-Wformat-security"
 		switch (pp->pt_action) {
 		    case AC_IGNORE:
-			break;
+			if (!bt)
+				break;
+
+			/* select the alternative, and replay from there */
+			rbuf[0] = bt_c;
+			memcpy(rbuf+1, pend, n = npend);
+			alt = bt;
+			bt = NULL;
+			st = bt_st;
+			pp = NULL;
+			nump = bt_nump;
+			p[0] = bt_p[0];
+			p[1] = bt_p[1];
+			PT_SAVE();
+			rv = traced ? xlate_traced(e, rbuf, n+1)
+				    : xlate_generic(e, rbuf, n+1);
+			PT_LOAD();
+			if (rv < 0)
+				break;
+			continue;
 
 		    case AC_PRINT:
-			rv = write(STDOUT_FILENO, &c, 1);
+			rv = out_write(e, &c, 1);
 			break;
 
 		    case AC_FMT:
 		    case AC_STLINE:
-			rv = dprintf(STDOUT_FILENO, (char *)pp->pt_ptr);
+			rv = out_emit(e, pp->pt_emit, 0, 0);
 			break;
 
 		    case AC_FMT1:
 			if (nump != 1) {
 				fprintf(stderr, "\r\ninternal error: fmt1\r\n");
-				dump_pt(pt, 0);
+				dump_pt(e, st, 0);
 				if (debug)
 					abort();
 				return -1;
 			}
 
 			/* these are usually # rows, # cols, or # chars */
-			rv = dprintf(STDOUT_FILENO, (char *)pp->pt_ptr, p[0]);
+			rv = out_emit(e, pp->pt_emit, p[0], 0);
 			break;
 
 		    case AC_FMT2_REV:
@@ -922,44 +2403,506 @@ log_end:
 		    case AC_FMT2:
 			if (nump != 2) {
 				fprintf(stderr, "\r\ninternal error: fmt2\r\n");
-				dump_pt(pt, 0);
+				dump_pt(e, st, 0);
 				if (debug)
 					abort();
 				return -1;
 			}
 
 			/* Hazeltine row/col. can be specified multiple ways */
-			if (term_hz) {
+			if (e->term_hz) {
 				p[0] %= 32;
 				p[1] %= 96;
 			}
 
 			/* ensure in range */
-			p[0] = MIN(p[0], term_lines-1);
-			p[1] = MIN(p[1], term_cols-1);
+			p[0] = MIN(p[0], e->term_lines-1);
+			p[1] = MIN(p[1], e->term_cols-1);
 
 			/* termcap row, col are 0-based, ANSI is 1-based */
-			rv = dprintf(STDOUT_FILENO, (char *)pp->pt_ptr,
-						    p[0]+1, p[1]+1);
+			rv = out_cm(e, pp->pt_emit, p[0]+1, p[1]+1);
 			break;
 
 		    case AC_LL:
-			rv = dprintf(STDOUT_FILENO, (char *)pp->pt_ptr,
-						    term_lines);
+			rv = out_emit(e, pp->pt_emit, e->term_lines, 0);
+			break;
+
+		    case AC_REGION:
+			if (nump != 2) {
+				fprintf(stderr, "\r\ninternal error: region\r\n");
+				dump_pt(e, st, 0);
+				if (debug)
+					abort();
+				return -1;
+			}
+
+			/* keep top and bottom rows on the emulated screen */
+			rv = out_emit(e, pp->pt_emit, MIN(p[0], e->term_lines-1)+1,
+				      MIN(p[1], e->term_lines-1)+1);
 			break;
 
 		    case AC_NEXT:
-			pt = pp->pt_ptr;
+			st = pp->pt_next;
 			pp = NULL;
 			continue;
 		}
-#pragma GCC diagnostic pop
 
 		if (rv < 0)
 			break;
-		pt = parsetab;
+		st = 0;
 		pp = NULL;
+		bt = NULL;
 		nump = p[0] = p[1] = 0;
+		if (again) {
+			again = 0;
+			goto next_level;
+		}
+	}
+	PT_SAVE();
+	return rv;
+}
+#undef TRACE
+#undef PT_LOAD
+#undef PT_SAVE
+
+int xlate_generic(struct emu *e, unsigned char *buf, int rc)
+{
+	return xlate_pt(e, buf, rc, 0);
+}
+
+int xlate_traced(struct emu *e, unsigned char *buf, int rc)
+{
+	return xlate_pt(e, buf, rc, 1);
+}
+
+
+/*
+ * The state machine of xlate_vt(): for each state and character, an
+ * action in the high bits and the next state in the low 4 bits.  C0
+ * controls are handled by the parse table even within a sequence, as a
+ * VT100 does; CAN and SUB cancel it, and ESC starts a new one.  Strings
+ * (OSC, DCS, SOS, PM, APC) are consumed until BEL or ST.
+ */
+enum vt_state {
+	VS_GROUND = 0, VS_ESC, VS_ESC_INTER, VS_CSI_ENTRY, VS_CSI_PARAM,
+	VS_CSI_INTER, VS_CSI_IGNORE, VS_STRING
+};
+
+enum vt_action {
+	VA_NONE = 0,
+	VA_ROOT,		/* root of the parse table */
+	VA_CLEAR,		/* start a sequence */
+	VA_PRIV,		/* private marker */
+	VA_INTER,		/* intermediate */
+	VA_PARAM,		/* parameter digit or ; */
+	VA_ESC,			/* dispatch ESC sequence */
+	VA_CSI,			/* dispatch CSI sequence */
+};
+
+#define T(a, s)	((a) << 4 | (s))
+#define C0(s)	[0x00 ... 0x1f] = T(VA_ROOT, s),		\
+		[0x18] = T(VA_ROOT, VS_GROUND),			\
+		[0x1a] = T(VA_ROOT, VS_GROUND),			\
+		[0x1b] = T(VA_CLEAR, VS_ESC)
+
+static const unsigned char vt_table[][128] = {
+    [VS_GROUND] = {
+	C0(VS_GROUND),
+	[0x20 ... 0x7f] = T(VA_ROOT, VS_GROUND),
+    },
+    [VS_ESC] = {
+	C0(VS_ESC),
+	[0x20 ... 0x2f] = T(VA_INTER, VS_ESC_INTER),
+	[0x30 ... 0x7e] = T(VA_ESC, VS_GROUND),
+	['['] = T(VA_CLEAR, VS_CSI_ENTRY),
+	[']'] = T(VA_NONE, VS_STRING),
+	['P'] = T(VA_NONE, VS_STRING),
+	['X'] = T(VA_NONE, VS_STRING),
+	['^'] = T(VA_NONE, VS_STRING),
+	['_'] = T(VA_NONE, VS_STRING),
+	[0x7f] = T(VA_NONE, VS_ESC),
+    },
+    [VS_ESC_INTER] = {
+	C0(VS_ESC_INTER),
+	[0x20 ... 0x2f] = T(VA_INTER, VS_ESC_INTER),
+	[0x30 ... 0x7e] = T(VA_ESC, VS_GROUND),
+	[0x7f] = T(VA_NONE, VS_ESC_INTER),
+    },
+    [VS_CSI_ENTRY] = {
+	C0(VS_CSI_ENTRY),
+	[0x20 ... 0x2f] = T(VA_INTER, VS_CSI_INTER),
+	[0x30 ... 0x39] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3a] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x3b] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3c ... 0x3f] = T(VA_PRIV, VS_CSI_PARAM),
+	[0x40 ... 0x7e] = T(VA_CSI, VS_GROUND),
+	[0x7f] = T(VA_NONE, VS_CSI_ENTRY),
+    },
+    [VS_CSI_PARAM] = {
+	C0(VS_CSI_PARAM),
+	[0x20 ... 0x2f] = T(VA_INTER, VS_CSI_INTER),
+	[0x30 ... 0x39] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3a] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x3b] = T(VA_PARAM, VS_CSI_PARAM),
+	[0x3c ... 0x3f] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x40 ... 0x7e] = T(VA_CSI, VS_GROUND),
+	[0x7f] = T(VA_NONE, VS_CSI_PARAM),
+    },
+    [VS_CSI_INTER] = {
+	C0(VS_CSI_INTER),
+	[0x20 ... 0x2f] = T(VA_INTER, VS_CSI_INTER),
+	[0x30 ... 0x3f] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x40 ... 0x7e] = T(VA_CSI, VS_GROUND),
+	[0x7f] = T(VA_NONE, VS_CSI_INTER),
+    },
+    [VS_CSI_IGNORE] = {
+	C0(VS_CSI_IGNORE),
+	[0x20 ... 0x3f] = T(VA_NONE, VS_CSI_IGNORE),
+	[0x40 ... 0x7e] = T(VA_NONE, VS_GROUND),
+	[0x7f] = T(VA_NONE, VS_CSI_IGNORE),
+    },
+    [VS_STRING] = {
+	[0x00 ... 0x7f] = T(VA_NONE, VS_STRING),
+	[0x07] = T(VA_NONE, VS_GROUND),		/* xterm ends OSC w/BEL */
+	[0x18] = T(VA_NONE, VS_GROUND),
+	[0x1a] = T(VA_NONE, VS_GROUND),
+	[0x1b] = T(VA_CLEAR, VS_ESC),		/* ST is ESC \ */
+    },
+};
+#undef T
+#undef C0
+
+static char nocap[2];
+
+/* find the candidate for the collected sequence */
+struct vtcand *vt_match(struct emu *e, int kind, int final)
+{
+	struct vtseq *vt = &e->vt;
+	struct vtcand *vc, *pad = NULL;
+	int i, v;
+
+	for (vc = e->vt_cands[kind][final - '0']; vc; vc = vc->vc_next) {
+		if (vc->vc_priv != vt->vs_priv || vc->vc_inter != vt->vs_inter)
+			continue;
+
+		/* parameters absent from either are 0 (default) */
+		for (i = 0; i < MAX(vc->vc_nparam, vt->vs_nparam); i++) {
+			v = i < vt->vs_nparam ? vt->vs_param[i] : 0;
+			if (i < vc->vc_nparam ? vc->vc_param[i] >= 0 &&
+						vc->vc_param[i] != v
+					      : v != 0)
+				break;
+		}
+		if (i < MAX(vc->vc_nparam, vt->vs_nparam))
+			continue;
+		if (vc->vc_nparam == vt->vs_nparam)
+			return vc;
+		if (!pad)
+			pad = vc;
+	}
+	return pad;
+}
+
+/* do the action of candidate vc for the collected sequence */
+int vt_out(struct emu *e, struct vtcand *vc, int *p)
+{
+	struct vtseq *vt = &e->vt;
+	int i, t;
+
+	for (i = 0; i < 2; i++) {
+		t = vc->vc_argpos[i];
+		p[i] = t < vt->vs_nparam ? vt->vs_param[t] - vc->vc_inc : 0;
+		if (p[i] < 0)
+			p[i] = 0;
+	}
+
+	switch (vc->vc_action) {
+	    case AC_FMT:
+	    case AC_STLINE:
+		return out_emit(e, vc->vc_emit, 0, 0);
+
+	    case AC_FMT1:
+		return out_emit(e, vc->vc_emit, p[0], 0);
+
+	    case AC_FMT2_REV:
+		t = p[0];
+		p[0] = p[1];
+		p[1] = t;
+		/* FALL THRU */
+	    case AC_FMT2:
+		return out_cm(e, vc->vc_emit, MIN(p[0], e->term_lines-1) + 1,
+			      MIN(p[1], e->term_cols-1) + 1);
+
+	    case AC_LL:
+		return out_emit(e, vc->vc_emit, e->term_lines, 0);
+
+	    case AC_REGION:
+		return out_emit(e, vc->vc_emit, MIN(p[0], e->term_lines-1) + 1,
+				MIN(p[1], e->term_lines-1) + 1);
+	}
+	return 0;
+}
+
+/* dispatch the collected sequence, return its candidate in *vcp */
+int vt_dispatch(struct emu *e, int kind, int final, int *p,
+		struct vtcand **vcp)
+{
+	struct vtseq *vt = &e->vt;
+	unsigned short param[VT_NPARAM];
+	int i, n, rv = 0;
+
+	if (*vcp = vt_match(e, kind, final))
+		return vt_out(e, *vcp, p);
+
+	/* SGR parameters are independent, so try them one at a time */
+	if (kind != VK_CSI || final != 'm' || vt->vs_priv || vt->vs_inter ||
+	    (n = vt->vs_nparam) < 2)
+		return 0;
+	memcpy(param, vt->vs_param, sizeof param);
+	vt->vs_nparam = 1;
+	for (i = 0; i < n && rv >= 0; i++) {
+		vt->vs_param[0] = param[i];
+		if (*vcp = vt_match(e, kind, final))
+			rv = vt_out(e, *vcp, p);
+	}
+	return rv;
+}
+
+static inline __attribute__((always_inline))
+int xlate_vt_pt(struct emu *e, unsigned char *buf, int rc, const int traced)
+{
+	int (*scan)(struct emu *, unsigned char *, int, char *) = e->scan_print;
+	struct vtseq *vt = &e->vt;
+	struct vtcand *vc;
+	struct pentry *pp;
+	long long ns = traced ? mono_ns() : 0;
+	int i, n, t, rv = 0, p[2] = { 0, 0 };
+	char c;
+
+	for (i = 0; i < rc; i++) {
+		/* in the ground state, copy a run of printable chars in bulk */
+		if (!traced && scan && vt->vs_state == VS_GROUND) {
+			if (e->olen + rc-i > sizeof e->obuf &&
+			    (rv = flush_output(e)) < 0)
+				break;
+			n = (*scan)(e, buf+i, MIN(rc-i, sizeof e->obuf - e->olen),
+				    e->obuf + e->olen);
+			e->olen += n;
+			if ((i += n) == rc)
+				break;
+		}
+
+		c = buf[i] & 0x7f;	/* strip parity bit */
+		t = vt_table[vt->vs_state][c];
+		vt->vs_state = t & 0xf;
+
+		switch (t >> 4) {
+		    case VA_NONE:
+			if (traced)
+				add_trace(ns, c, AC_NEXT, nocap, p);
+			break;
+
+		    case VA_ROOT:
+			pp = PENTRY(e, 0, c);
+			if (traced)
+				add_trace(ns, c, pp->pt_action, pp->pt_cap, p);
+			if (pp->pt_action == AC_PRINT)
+				rv = out_write(e, &c, 1);
+			else if (pp->pt_action == AC_FMT ||
+				 pp->pt_action == AC_STLINE)
+				rv = out_emit(e, pp->pt_emit, 0, 0);
+			break;
+
+		    case VA_CLEAR:
+			vt->vs_priv = vt->vs_inter = 0;
+			vt->vs_nparam = 0;
+			vt->vs_param[0] = 0;
+			if (traced)
+				add_trace(ns, c, AC_NEXT, nocap, p);
+			break;
+
+		    case VA_PRIV:
+			vt->vs_priv = c;
+			if (traced)
+				add_trace(ns, c, AC_NEXT, nocap, p);
+			break;
+
+		    case VA_INTER:
+			vt->vs_inter = vt->vs_inter ? 0xff : c;
+			if (traced)
+				add_trace(ns, c, AC_NEXT, nocap, p);
+			break;
+
+		    case VA_PARAM:
+			if (!vt->vs_nparam)
+				vt->vs_nparam = 1;
+			if (c == ';') {
+				if (vt->vs_nparam < VT_NPARAM)
+					vt->vs_param[vt->vs_nparam++] = 0;
+			} else if (vt->vs_param[vt->vs_nparam-1] < 10000) {
+				n = vt->vs_param[vt->vs_nparam-1]*10 + c - '0';
+				vt->vs_param[vt->vs_nparam-1] = n;
+			}
+			if (traced)
+				add_trace(ns, c, AC_NEXT, nocap, p);
+			break;
+
+		    case VA_ESC:
+		    case VA_CSI:
+			rv = vt_dispatch(e, t >> 4 == VA_CSI ? VK_CSI : VK_ESC,
+					 c, p, &vc);
+			if (traced)
+				add_trace(ns, c, vc ? vc->vc_action : AC_IGNORE,
+					  vc ? vc->vc_cap : nocap, p);
+			p[0] = p[1] = 0;
+			break;
+		}
+		if (rv < 0)
+			break;
 	}
 	return rv;
 }
+
+int xlate_vt(struct emu *e, unsigned char *buf, int rc)
+{
+	return xlate_vt_pt(e, buf, rc, 0);
+}
+
+int xlate_vt_traced(struct emu *e, unsigned char *buf, int rc)
+{
+	return xlate_vt_pt(e, buf, rc, 1);
+}
+
+
+/*
+ * Unless output is passed through as-is, the master is in packet mode:
+ * each read starts with a status byte, and the event loop polls for
+ * POLLPRI while paced output is queued.  When the child's tty discards
+ * its output (e.g. ^C or ^O), so does emuterm, like a slow terminal:
+ * what is paced or held is dropped.  The kernel empties the pty's own
+ * buffers, except for what the master's line discipline already has (up
+ * to 4KB); that can't be told from what the tty writes after the flush,
+ * e.g. the ^C echo, so it is all kept.
+ */
+
+/* put e's master in packet mode, unless already tried */
+void pkt_enable(struct emu *e, int mfd)
+{
+	int on = 1;
+
+	if (!e->pkt_mode)
+		e->pkt_mode = ioctl(mfd, TIOCPKT, &on) == 0 ? 1 : -1;
+}
+
+/* handle a status byte from the master, return its length */
+int pkt_status(unsigned char status)
+{
+	if (status & TIOCPKT_FLUSHWRITE) {
+		pq_len = 0;
+		emu_cur->olen = 0;
+		emu_cur->ofirst = 0;
+		if (ur_on)
+			ur_discard();
+	}
+	return 1;
+}
+
+/* read output from slave pty, write to user */
+int handle_output(int mfd)
+{
+	struct emu *e = emu_cur;
+	unsigned char status, *data;
+	int n, rc, rv = 0, on;
+
+	if (!e->term_set && !ocps && !coalesce_us && !ur_on) {
+		if (e->pkt_mode > 0) {	/* splice needs plain data */
+			on = 0;
+			ioctl(mfd, TIOCPKT, &on);
+			e->pkt_mode = 0;
+		}
+		return pass_output(mfd);
+	}
+	pkt_enable(e, mfd);
+
+	/*
+	 * While paced output is queued, or too much for the user, just
+	 * check for a status change.
+	 */
+	if (pq_len || user_full()) {
+		if (e->pkt_mode < 0)
+			return 0;
+		if ((rc = read(mfd, &status, 1)) <= 0)
+			return rc;
+		return pkt_status(status);
+	}
+
+	if (!e->hbuf && !(e->hbuf = malloc(rsize_max)))
+		return -1;
+
+	/* when pacing, don't read far ahead: the child can't tell */
+	n = ocps ? RSIZE_MIN : e->hsize;
+	if ((rc = ur_on ? ur_read(mfd, e->hbuf, n)
+			: read(mfd, e->hbuf, n)) <= 0)
+		return rc;
+	if (!ocps)
+		e->hsize = adapt_rsize(e->hsize, rc);
+	data = (unsigned char *)e->hbuf;
+	n = rc;
+	if (e->pkt_mode > 0) {
+		if (*data != TIOCPKT_DATA)
+			return pkt_status(*data);
+		data++;
+		n--;
+	}
+	if (e->savefd >= 0 && ur_on)
+		ur_write(e->savefd, (char *)data, n);
+	else if (e->savefd >= 0)
+		write(e->savefd, data, n);
+	if (ocps) {
+		pq = data;
+		pq_len = n;
+	} else
+		rv = (*e->xlate)(e, data, n);
+	if (e->olen) {
+		e->olast = mono_ns();
+		if (!e->ofirst)
+			e->ofirst = e->olast;
+	}
+	if (rv >= 0 && check_output() < 0)
+		rv = -1;
+	return rv < 0 ? rv : rc;
+}
+
+/*
+ * Read output from a background session's slave.  It's recorded, and
+ * translated into the session's virtual screen, but not written, paced
+ * or coalesced.
+ */
+int bg_output(struct emu *e, int mfd)
+{
+	unsigned char *data;
+	int n, rc, rv;
+
+	pkt_enable(e, mfd);
+	if (!e->hbuf && !(e->hbuf = malloc(rsize_max)))
+		return -1;
+	if ((rc = read(mfd, e->hbuf, e->hsize)) <= 0)
+		return rc;
+	e->hsize = adapt_rsize(e->hsize, rc);
+	data = (unsigned char *)e->hbuf;
+	n = rc;
+	if (e->pkt_mode > 0) {
+		if (*data != TIOCPKT_DATA)	/* nothing is held */
+			return 1;
+		data++;
+		n--;
+	}
+	if (e->savefd >= 0)
+		write(e->savefd, data, n);
+	out_hidden = 1;
+	rv = (*e->xlate)(e, data, n);
+	if (rv >= 0)
+		rv = flush_output(e);
+	out_hidden = 0;
+	return rv < 0 ? rv : rc;
+}
@@ -22,12 +22,37 @@
 #ifndef _OUTPUT_H
 #define _OUTPUT_H 1
 
-extern int term_set;
-extern char *term_arrows[4];
+#define OBUF_SIZE	16384		/* translated output buffer */
 
-extern char *set_termtype(char *term, struct winsize *ws, char *errbuf);
+/* what takes no context works on emu_cur, the one emuterm shows */
+struct emu;
+
+extern long coalesce_us;
+extern int ocps, pq_len, uq_len;
+extern int coalesce_max;
+extern int out_hidden;
+
+extern char *set_termtype(struct emu *e, char *term, struct winsize *ws,
+			  char *errbuf);
+extern void oterm(int on);
 extern void omode(int raw);
+extern void pkt_enable(struct emu *e, int mfd);
 extern int handle_output(int mfd);
+extern int bg_output(struct emu *e, int mfd);
+extern int write_all(int fd, char *buf, int len);
+extern int write_user(char *buf, int len);
+extern int flush_user(void);
+extern int drain_user(void);
+extern int user_full(void);
+extern int out_write(struct emu *e, char *s, int n);
+extern int flush_output(struct emu *e);
+extern int hide_output(void);
+extern int check_output(void);
+extern long long output_wait(void);
+extern long long pace_wait(long long *t0, long long *n, int cps);
+extern void out_msg(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 extern void save_output(char *path);
+extern void save_trace(char *path);
+extern int set_pace(int cps);
 
 #endif /* _OUTPUT_H */
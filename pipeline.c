@@ -0,0 +1,453 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * With -P, while output is translated but not paced, held or traced,
+ * three threads take over the event loop's output path, so translating
+ * and recording overlap reading the master and writing to the user:
+ *
+ *	reader -> rq -> translator -> wq -> writer -> stdout
+ *		   \--------------------------/ -> savefd
+ *
+ * The rings are lock-free, single-producer and single-consumer, except
+ * that the writer reads rq too, for the recording, with its own tail.
+ * The reader reads straight into rq, with packet mode's status byte split
+ * off by readv(), and the writer writes straight from the rings, so the
+ * only copy the single-threaded loop doesn't make is the translator's
+ * output into wq.
+ * Each read is translated and flushed to wq, and the writer writes what
+ * it finds there, so output is in order.  A stage wakes the next only
+ * once it has PL_BATCH bytes for it, or has nothing more to do, so with
+ * few CPUs the threads don't take turns a read at a time, but output
+ * is never held.
+ *
+ * It only pays off with CPUs to spare: on a host with one, the stages just
+ * take turns, costing a few percent more CPU per MB than the loop alone
+ * (the copy into wq, and switching threads), so -P is ignored there.
+ *
+ * The event loop keeps handling input, and stops the pipeline before it
+ * writes to the user itself, or changes what the threads depend on:
+ * pl_stop() lets them finish what they've read, and the translator's
+ * state carries over to the single-threaded loop, which restarts the
+ * pipeline once pl_ready().  The threads stop on their own when the
+ * child closes the pty or a write to the user fails, and then pl_efd
+ * is readable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include "emuterm.h"
+#include "emu.h"
+#include "output.h"
+#include "pipeline.h"
+#include "screen.h"
+#include "xlate.h"
+#include "trace.h"
+#include "uring.h"
+
+
+#define PL_RING		(1 << 20)	/* bytes per ring, power of 2 */
+#define PL_BATCH	(PL_RING / 8)	/* wake the consumers this often */
+
+/* stage i produces ring i, and consumes ring i-1 */
+enum { PL_READ, PL_XLATE, PL_WRITE, PL_NSTAGES };
+
+struct stage {
+	pthread_t	st_tid;
+	int		st_efd;		/* eventfd to wake it */
+	atomic_int	st_asleep;	/* ...needed only while set */
+};
+
+struct ring {
+	char		*rg_buf;
+	atomic_ulong	rg_head;	/* bytes ever put */
+	atomic_ulong	rg_tail[2];	/* bytes ever taken, per consumer */
+	atomic_int	rg_closed;	/* no more will be put */
+	unsigned long	rg_woke;	/* rg_head when they were woken */
+	int		rg_ncons;
+	struct stage	*rg_prod, *rg_cons[2];
+};
+
+int pl_mode = 0;		/* -P */
+int pl_on = 0;			/* the threads are running */
+int pl_efd = -1;		/* readable once they stop on their own */
+int pl_err = 0;			/* errno of a failed write to the user */
+
+struct stage pl_st[PL_NSTAGES];
+struct ring pl_rg[2];		/* rq, wq */
+atomic_int pl_quit;		/* pl_stop() was called */
+int pl_mfd, pl_save;
+struct emu *pl_emu;		/* the context whose output it is */
+
+
+void pl_wake(struct stage *st)
+{
+	uint64_t one = 1;
+
+	if (atomic_load(&st->st_asleep))
+		write(st->st_efd, &one, sizeof one);
+}
+
+/*
+ * Sleep until woken, or until fd (if any) is ready.  The caller sets
+ * st_asleep, then checks once more for what it's waiting for, so a
+ * wakeup can't be missed.
+ */
+void pl_sleep(struct stage *st, int fd, short events)
+{
+	struct pollfd pfds[2];
+	uint64_t n;
+
+	pfds[0].fd = st->st_efd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = fd;
+	pfds[1].events = events;
+	(void) poll(pfds, fd >= 0 ? 2 : 1, -1);
+	atomic_store(&st->st_asleep, 0);
+	read(st->st_efd, &n, sizeof n);
+}
+
+
+/* bytes consumer i hasn't taken, and where the first run of them is */
+unsigned long rg_get(struct ring *rg, int i, char **p)
+{
+	unsigned long tail = atomic_load(&rg->rg_tail[i]);
+	unsigned long n = atomic_load(&rg->rg_head) - tail;
+	unsigned off = tail & (PL_RING-1);
+
+	*p = rg->rg_buf + off;
+	return MIN(n, PL_RING - off);
+}
+
+void rg_take(struct ring *rg, int i, unsigned long n)
+{
+	atomic_fetch_add(&rg->rg_tail[i], n);
+	pl_wake(rg->rg_prod);
+}
+
+/* wake the consumers for what's been put since they last were */
+void rg_wake(struct ring *rg)
+{
+	int i;
+
+	rg->rg_woke = atomic_load(&rg->rg_head);
+	for (i = 0; i < rg->rg_ncons; i++)
+		pl_wake(rg->rg_cons[i]);
+}
+
+unsigned long rg_room(struct ring *rg)
+{
+	unsigned long tail = atomic_load(&rg->rg_tail[0]);
+
+	if (rg->rg_ncons > 1)
+		tail = MIN(tail, atomic_load(&rg->rg_tail[1]));
+	return PL_RING - (atomic_load(&rg->rg_head) - tail);
+}
+
+/* wait for room in ring, return how much, and where the first run is */
+unsigned long rg_space(struct ring *rg, char **p)
+{
+	unsigned long n;
+	unsigned off;
+
+	while (!(n = rg_room(rg))) {
+		rg_wake(rg);
+		atomic_store(&rg->rg_prod->st_asleep, 1);
+		if (!rg_room(rg))
+			pl_sleep(rg->rg_prod, -1, 0);
+		else
+			atomic_store(&rg->rg_prod->st_asleep, 0);
+	}
+	off = atomic_load(&rg->rg_head) & (PL_RING-1);
+	*p = rg->rg_buf + off;
+	return MIN(n, PL_RING - off);
+}
+
+/* n bytes were put at rg_space() */
+void rg_commit(struct ring *rg, unsigned long n)
+{
+	unsigned long head = atomic_load(&rg->rg_head) + n;
+
+	atomic_store(&rg->rg_head, head);
+	if (head - rg->rg_woke >= PL_BATCH)
+		rg_wake(rg);
+}
+
+/* put all of buf in ring, waiting for room as necessary */
+void rg_put(struct ring *rg, char *buf, unsigned long len)
+{
+	unsigned long n;
+	char *p;
+
+	while (len > 0) {
+		n = MIN(rg_space(rg, &p), len);
+		memcpy(p, buf, n);
+		rg_commit(rg, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+void rg_close(struct ring *rg)
+{
+	atomic_store(&rg->rg_closed, 1);
+	rg_wake(rg);
+}
+
+/* has consumer i taken everything, and will there be no more? */
+int rg_done(struct ring *rg, int i)
+{
+	char *p;
+
+	return atomic_load(&rg->rg_closed) && !rg_get(rg, i, &p);
+}
+
+/* the sink of pl_emu's translator */
+int pl_put(char *buf, int len)
+{
+	rg_put(&pl_rg[PL_XLATE], buf, len);
+	return 0;
+}
+
+
+void *pl_reader(void *arg)
+{
+	struct stage *st = &pl_st[PL_READ];
+	struct ring *rq = &pl_rg[PL_READ];
+	struct iovec iov[2];
+	unsigned char status;
+	int n, k = pl_emu->pkt_mode > 0;
+
+	iov[0].iov_base = &status;
+	iov[0].iov_len = 1;
+	while (!atomic_load(&pl_quit)) {
+		iov[1].iov_len = MIN(rg_space(rq, (char **)&iov[1].iov_base),
+				     rsize_max);
+		if ((n = readv(pl_mfd, iov + !k, 1 + k)) < 0 &&
+		    (errno == EAGAIN || errno == EINTR)) {
+			rg_wake(&pl_rg[PL_READ]);
+			atomic_store(&st->st_asleep, 1);
+			if (!atomic_load(&pl_quit))
+				pl_sleep(st, pl_mfd, POLLIN|POLLPRI);
+			atomic_store(&st->st_asleep, 0);
+			continue;
+		}
+		if (n <= 0)		/* EIO: the child closed the pty */
+			break;
+		if (k && status != TIOCPKT_DATA)	/* unpaced: nothing held */
+			continue;
+		rg_commit(rq, n - k);
+	}
+	rg_close(&pl_rg[PL_READ]);
+	return NULL;
+}
+
+void *pl_xlator(void *arg)
+{
+	struct stage *st = &pl_st[PL_XLATE];
+	struct ring *rq = &pl_rg[PL_READ];
+	unsigned long n;
+	char *p;
+
+	while (!rg_done(rq, 0)) {
+		if ((n = rg_get(rq, 0, &p))) {
+			(*pl_emu->xlate)(pl_emu, (unsigned char *)p, n);
+			flush_output(pl_emu);
+			rg_take(rq, 0, n);
+			continue;
+		}
+		rg_wake(&pl_rg[PL_XLATE]);
+		atomic_store(&st->st_asleep, 1);
+		if (!rg_get(rq, 0, &p) && !atomic_load(&rq->rg_closed))
+			pl_sleep(st, -1, 0);
+		atomic_store(&st->st_asleep, 0);
+	}
+	rg_close(&pl_rg[PL_XLATE]);
+	return NULL;
+}
+
+void *pl_writer(void *arg)
+{
+	struct stage *st = &pl_st[PL_WRITE];
+	struct ring *rq = &pl_rg[PL_READ], *wq = &pl_rg[PL_XLATE];
+	unsigned long n;
+	uint64_t one = 1;
+	long k;
+	int busy;
+	char *p;
+
+	while (!rg_done(wq, 0) || pl_save && !rg_done(rq, 1)) {
+		busy = 0;
+		if (pl_save && (n = rg_get(rq, 1, &p))) {
+			write(pl_emu->savefd, p, n);
+			rg_take(rq, 1, n);
+			busy = 1;
+		}
+		if ((n = rg_get(wq, 0, &p))) {
+			k = pl_err ? n : write(STDOUT_FILENO, p, n);
+			if (k < 0 && errno == EAGAIN) {
+				atomic_store(&st->st_asleep, 1);
+				pl_sleep(st, STDOUT_FILENO, POLLOUT);
+				continue;
+			}
+			if (k < 0) {
+				if (errno == EINTR)
+					continue;
+				pl_err = errno;	/* discard the rest */
+				atomic_store(&pl_quit, 1);
+				pl_wake(&pl_st[PL_READ]);
+				k = n;
+			}
+			rg_take(wq, 0, k);
+			busy = 1;
+		}
+		if (busy)
+			continue;
+		atomic_store(&st->st_asleep, 1);
+		if (!rg_get(wq, 0, &p) && !atomic_load(&wq->rg_closed) &&
+		    !(pl_save && rg_get(rq, 1, &p)))
+			pl_sleep(st, -1, 0);
+		atomic_store(&st->st_asleep, 0);
+	}
+	write(pl_efd, &one, sizeof one);
+	return NULL;
+}
+
+void *(*pl_fn[PL_NSTAGES])(void *) = { pl_reader, pl_xlator, pl_writer };
+
+
+/* can the pipeline take over output now? */
+int pl_ready(void)
+{
+	struct emu *e = emu_cur;
+
+	return pl_mode && !ur_on && e->term_set && !ocps && !coalesce_us &&
+	       !e->scr_on && !tring && !pq_len && !e->olen && !uq_len;
+}
+
+/* start the threads, return -1 (and turn off -P) if they can't be */
+int pl_start(int mfd)
+{
+	sigset_t all, old;
+	int i, pkt, on, err;
+
+	/* on one CPU the stages take turns, and the loop alone is faster */
+	if (pl_efd < 0 && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+		pl_mode = 0;
+		return -1;
+	}
+	if (pl_efd < 0) {
+		for (i = 0; i < PL_NSTAGES; i++) {
+			if ((pl_st[i].st_efd = eventfd(0, EFD_NONBLOCK |
+							  EFD_CLOEXEC)) < 0)
+				goto fail;
+		}
+		for (i = 0; i < 2; i++) {
+			if (!(pl_rg[i].rg_buf = malloc(PL_RING)))
+				goto fail;
+			pl_rg[i].rg_prod = &pl_st[i];
+			pl_rg[i].rg_cons[0] = &pl_st[i+1];
+		}
+		pl_rg[PL_READ].rg_cons[1] = &pl_st[PL_WRITE];
+		if ((pl_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+			goto fail;
+	}
+
+	pl_mfd = mfd;
+	pl_emu = emu_cur;
+	pl_save = pl_emu->savefd >= 0;
+	pl_err = 0;
+	atomic_store(&pl_quit, 0);
+	for (i = 0; i < 2; i++) {
+		atomic_store(&pl_rg[i].rg_head, 0);
+		atomic_store(&pl_rg[i].rg_tail[0], 0);
+		atomic_store(&pl_rg[i].rg_tail[1], 0);
+		atomic_store(&pl_rg[i].rg_closed, 0);
+		pl_rg[i].rg_woke = 0;
+		pl_rg[i].rg_ncons = 1;
+	}
+	if (pl_save)
+		pl_rg[PL_READ].rg_ncons = 2;
+	pkt = pl_emu->pkt_mode;
+	pkt_enable(pl_emu, mfd);
+	pl_emu->sink = pl_put;
+
+	/* signals are for the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = PL_NSTAGES-1; i >= 0; i--) {
+		atomic_store(&pl_st[i].st_asleep, 0);
+		if ((errno = pthread_create(&pl_st[i].st_tid, NULL,
+					    pl_fn[i], NULL)))
+			break;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (i >= 0) {
+		/* the stages after i drain what they have and stop */
+		if (i < PL_WRITE)
+			rg_close(&pl_rg[i]);
+		while (++i < PL_NSTAGES)
+			pthread_join(pl_st[i].st_tid, NULL);
+		pl_emu->sink = NULL;
+
+		/* the loop reads as it did */
+		err = errno;
+		if (!pkt && pl_emu->pkt_mode > 0) {
+			on = 0;
+			ioctl(mfd, TIOCPKT, &on);
+		}
+		pl_emu->pkt_mode = pkt;
+		errno = err;
+		goto fail;
+	}
+	pl_on = 1;
+	return 0;
+
+    fail:
+	out_msg("%s: can't pipeline output: %s\r\n", prog, strerror(errno));
+	pl_mode = 0;
+	return -1;
+}
+
+/* let the threads finish what they've read, and wait for them */
+void pl_stop(void)
+{
+	uint64_t n;
+	int i;
+
+	if (!pl_on)
+		return;
+	atomic_store(&pl_quit, 1);
+	pl_wake(&pl_st[PL_READ]);
+	for (i = 0; i < PL_NSTAGES; i++)
+		pthread_join(pl_st[i].st_tid, NULL);
+	read(pl_efd, &n, sizeof n);
+	pl_emu->sink = NULL;
+	pl_on = 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Pipelined output (-P): read, translate and write on separate threads.
+ */
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H 1
+
+extern int pl_mode, pl_on, pl_efd, pl_err;
+
+extern int pl_ready(void);
+extern int pl_start(int mfd);
+extern void pl_stop(void);
+
+#endif /* _PIPELINE_H */
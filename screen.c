@@ -0,0 +1,1182 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Virtual screen of the emulated terminal.
+ *
+ * While output is paced, the translated output written to the user is
+ * followed here, cell by cell.  On fast-forward (~f) it isn't written at
+ * all: it only updates the virtual screen, which is repainted every
+ * SCR_FRAME_NS by writing just the cells that differ from what the user's
+ * terminal shows.  However much scrolling and redrawing a burst of output
+ * does, it costs at most a screen's worth of writes per frame.
+ *
+ * Only the control sequences that the translators generate are followed.
+ * Anything else loses track of (part of) the screen, and output is
+ * written as-is until the screen is known again, e.g. after it's cleared
+ * and the cursor positioned.
+ *
+ * With -p, the virtual screen also predicts the echo of printable keys
+ * (see scr_predict).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "emuterm.h"
+#include "emu.h"
+#include "output.h"
+#include "screen.h"
+#include "xlate.h"
+
+
+#define SCR_FRAME_NS	40000000LL	/* repaint interval while collapsing */
+#define PE_MAX		64		/* most predictions outstanding */
+#define PE_TIMEOUT_NS	1000000000LL	/* echo overdue after this */
+#define SCR_UNKNOWN	0xffffffffu	/* cell contents unknown */
+#define SCR_BLANK	' '
+
+/* cells hold up to 3 bytes of UTF-8, and SGR attributes in the top byte */
+#define AT_BOLD		0x01
+#define AT_FAINT	0x02
+#define AT_UNDER	0x04
+#define AT_BLINK	0x08
+#define AT_INVERSE	0x10
+#define AT_HIDDEN	0x20
+
+/* what a sequence that isn't followed may have changed */
+#define L_CELLS		0x01
+#define L_ROW		0x02
+#define L_COL		0x04
+#define L_ATTR		0x08
+#define L_REGION	0x10
+#define L_MODES		0x20
+#define L_CURSOR	(L_ROW | L_COL)
+#define L_ALL		0x3f
+
+/*
+ * Each context has its own virtual screen (scr_cur, and scr_shown as the
+ * user's terminal last had it), so it can be repainted when shown.  What
+ * is shown, collapsed or predicted is emu_cur's.
+ */
+int scr_ff = 0;			/* collapsing output (~f) */
+int scr_keep = 0;		/* following it even when not paced */
+long long scr_due = 0;		/* when to repaint, 0 if nothing collapsed */
+int scr_full = 0;		/* repaint every cell */
+
+char rbuf[4096];		/* repaint output */
+int rlen;
+
+struct predict {
+	int		pe_row, pe_col;
+	unsigned	pe_ch;		/* the key, as a cell without attributes */
+	unsigned	pe_under;	/* the cell it covers */
+	int		pe_shown;	/* drawn on the user's screen */
+	long long	pe_due;		/* when its echo is overdue */
+};
+
+int predict_echo = 0;		/* -p, ~p */
+struct predict pe[PE_MAX];	/* oldest first, all on the cursor's row */
+int pe_n = 0;
+int pe_trust = 0;		/* an echo was seen, so show predictions */
+int pe_block = 0;		/* don't predict until pe[] drains */
+int pe_moved = 0;		/* user's cursor is after the predictions */
+
+
+#define CELL(sc, r, c)	((sc)->sc_cell + (r)*(sc)->sc_cols + (c))
+
+void scr_fill(unsigned *cp, int n, unsigned v)
+{
+	while (n-- > 0)
+		*cp++ = v;
+}
+
+/* forget what the last sequence may have changed */
+void scr_apply_loss(struct screen *sc)
+{
+	int what = sc->sc_lost;
+
+	sc->sc_lost = 0;
+	if ((what & L_CELLS) && sc->sc_known) {
+		scr_fill(sc->sc_cell, sc->sc_lines*sc->sc_cols, SCR_UNKNOWN);
+		sc->sc_known = 0;
+	}
+	if (what & L_ROW)
+		sc->sc_row = -1;
+	if (what & L_COL)
+		sc->sc_col = -1;
+	if (what & L_CURSOR)
+		sc->sc_wrap = 0;
+	if (what & L_ATTR)
+		sc->sc_attr = -1;
+	if (what & L_REGION)
+		sc->sc_top = -1;
+	if (what & L_MODES) {
+		sc->sc_ins = -1;
+		sc->sc_modes = 0;
+		sc->sc_saved = -1;
+	}
+}
+
+void scr_lose(struct screen *sc, int what)
+{
+	sc->sc_lost |= what;
+	if (!sc->sc_stop)
+		scr_apply_loss(sc);
+}
+
+int scr_complete(struct screen *sc)
+{
+	return sc->sc_known && sc->sc_row >= 0 && sc->sc_col >= 0 &&
+	       sc->sc_attr >= 0 && sc->sc_top >= 0 && sc->sc_ins >= 0 &&
+	       sc->sc_modes;
+}
+
+void scr_reset(struct emu *e, struct screen *sc, int known)
+{
+	scr_fill(sc->sc_cell, sc->sc_lines*sc->sc_cols,
+		 known ? SCR_BLANK : SCR_UNKNOWN);
+	sc->sc_known = known;
+	sc->sc_row = sc->sc_col = known ? 0 : -1;
+	sc->sc_wrap = 0;
+	sc->sc_attr = known ? 0 : -1;
+
+	/* emuterm sets the region at startup, then only "cs" changes it */
+	sc->sc_top = known || !e->term_cs ? 0 : -1;
+	sc->sc_bot = sc->sc_lines - 1;
+	sc->sc_ins = known || !e->term_im ? 0 : -1;
+	sc->sc_modes = 1;
+	sc->sc_saved = known ? 0 : -1;
+	sc->sc_st = SS_GROUND;
+	sc->sc_seqlen = 0;
+	sc->sc_stop = 0;
+	sc->sc_lost = 0;
+}
+
+void scr_copy(struct screen *to, struct screen *from)
+{
+	unsigned *cp = to->sc_cell;
+
+	memcpy(cp, from->sc_cell, from->sc_lines*from->sc_cols * sizeof *cp);
+	*to = *from;
+	to->sc_cell = cp;
+}
+
+
+/* start following e's output, from a blank screen if known */
+void scr_start(struct emu *e, int known)
+{
+	struct screen *cur = &e->scr_cur, *shown = &e->scr_shown;
+	struct winsize ws;
+	int n;
+
+	e->scr_on = 0;
+	scr_due = 0;
+	if (!e->term_set)
+		return;
+
+	/* the user's terminal has to wrap where the emulated one does */
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0)
+		return;
+	if (resize_win)
+		ws.ws_row = e->term_lines;
+	else if (ws.ws_col != e->term_cols || ws.ws_row < e->term_lines)
+		return;
+
+	if (cur->sc_lines != e->term_lines || cur->sc_cols != e->term_cols) {
+		free(cur->sc_cell);
+		free(shown->sc_cell);
+		cur->sc_lines = e->term_lines;
+		cur->sc_cols = e->term_cols;
+		n = cur->sc_lines * cur->sc_cols;
+		cur->sc_cell = malloc(n * sizeof (unsigned));
+		shown->sc_cell = malloc(n * sizeof (unsigned));
+		if (!cur->sc_cell || !shown->sc_cell) {
+			cur->sc_lines = cur->sc_cols = 0;
+			return;
+		}
+	}
+	cur->sc_xrows = ws.ws_row;
+	cur->sc_am = e->term_am;
+	scr_reset(e, cur, known);
+	pe_n = pe_trust = pe_block = pe_moved = 0;
+	e->scr_on = 1;
+}
+
+
+/* scroll rows top..bot up n lines, or down if n < 0 */
+void scr_scroll(struct screen *sc, int top, int bot, int n)
+{
+	int rows = bot - top + 1;
+
+	if (!sc->sc_known)
+		return;
+	if (n > rows)
+		n = rows;
+	if (n < -rows)
+		n = -rows;
+	if (n > 0) {
+		memmove(CELL(sc, top, 0), CELL(sc, top + n, 0),
+			(rows - n) * sc->sc_cols * sizeof (unsigned));
+		scr_fill(CELL(sc, bot - n + 1, 0), n * sc->sc_cols, SCR_BLANK);
+	} else if (n < 0) {
+		n = -n;
+		memmove(CELL(sc, top + n, 0), CELL(sc, top, 0),
+			(rows - n) * sc->sc_cols * sizeof (unsigned));
+		scr_fill(CELL(sc, top, 0), n * sc->sc_cols, SCR_BLANK);
+	}
+}
+
+/* line feed */
+void scr_index(struct screen *sc)
+{
+	sc->sc_wrap = 0;
+	if (sc->sc_row < 0) {
+		scr_lose(sc, L_CELLS);
+		return;
+	}
+	if (sc->sc_top < 0) {
+		scr_lose(sc, L_CELLS | L_ROW);
+		return;
+	}
+	if (sc->sc_row == sc->sc_bot)
+		scr_scroll(sc, sc->sc_top, sc->sc_bot, 1);
+	else if (sc->sc_row < sc->sc_lines - 1)
+		sc->sc_row++;
+	else if (sc->sc_xrows > sc->sc_lines)		/* off the emulated screen */
+		scr_lose(sc, L_ROW);
+}
+
+/* reverse index */
+void scr_rindex(struct screen *sc)
+{
+	sc->sc_wrap = 0;
+	if (sc->sc_row < 0) {
+		scr_lose(sc, L_CELLS);
+		return;
+	}
+	if (sc->sc_top < 0) {
+		scr_lose(sc, L_CELLS | L_ROW);
+		return;
+	}
+	if (sc->sc_row == sc->sc_top)
+		scr_scroll(sc, sc->sc_top, sc->sc_bot, -1);
+	else if (sc->sc_row > 0)
+		sc->sc_row--;
+}
+
+/* print one character, ch is its UTF-8 */
+void scr_print(struct screen *sc, unsigned ch)
+{
+	unsigned *cp;
+
+	if (sc->sc_wrap) {
+		sc->sc_col = 0;
+		scr_index(sc);
+		if (sc->sc_lost)
+			return;
+	}
+	if (sc->sc_row < 0 || sc->sc_col < 0 || sc->sc_attr < 0 ||
+	    sc->sc_ins < 0) {
+		scr_lose(sc, L_CELLS);
+		if (sc->sc_lost)
+			return;
+	} else if (sc->sc_known) {
+		cp = CELL(sc, sc->sc_row, sc->sc_col);
+		if (sc->sc_ins)
+			memmove(cp + 1, cp, (sc->sc_cols - sc->sc_col - 1) *
+					    sizeof *cp);
+		*cp = ch | sc->sc_attr << 24;
+	}
+	if (sc->sc_col < 0)
+		return;
+	if (sc->sc_col < sc->sc_cols - 1)
+		sc->sc_col++;
+	else if (sc->sc_am)
+		sc->sc_wrap = 1;
+}
+
+/* C0 control character */
+void scr_ctrl(struct screen *sc, int c)
+{
+	switch (c) {
+	    case '\0':
+	    case '\a':
+	    case 0177:
+		break;
+
+	    case '\b':
+		sc->sc_wrap = 0;
+		if (sc->sc_col > 0)
+			sc->sc_col--;
+		break;
+
+	    case '\t':
+		sc->sc_wrap = 0;
+		if (sc->sc_col >= 0)
+			sc->sc_col = MIN((sc->sc_col + 8) & ~7, sc->sc_cols - 1);
+		break;
+
+	    case '\n':
+	    case '\v':
+	    case '\f':
+		scr_index(sc);
+		break;
+
+	    case '\r':
+		sc->sc_wrap = 0;
+		sc->sc_col = 0;
+		break;
+
+	    default:		/* e.g. a character set shift */
+		scr_lose(sc, L_ALL);
+		break;
+	}
+}
+
+/* erase n cells from row, col */
+void scr_erase(struct screen *sc, int row, int col, int n)
+{
+	if (sc->sc_known)
+		scr_fill(CELL(sc, row, col), n, SCR_BLANK);
+}
+
+void scr_sgr(struct screen *sc)
+{
+	static const int on[10] = { 0, AT_BOLD, AT_FAINT, 0, AT_UNDER,
+				    AT_BLINK, 0, AT_INVERSE, AT_HIDDEN, 0 };
+	int i, p, attr = sc->sc_attr;
+
+	for (i = 0; i <= sc->sc_np; i++) {
+		p = sc->sc_p[i];
+		if (p == 0)
+			attr = 0;
+		else if (p < 10 && on[p]) {
+			if (attr >= 0)
+				attr |= on[p];
+		} else if (p == 22) {
+			if (attr >= 0)
+				attr &= ~(AT_BOLD | AT_FAINT);
+		} else if (p >= 24 && p < 29 && p != 26 && on[p - 20]) {
+			if (attr >= 0)
+				attr &= ~on[p - 20];
+		} else if (p != 39 && p != 49) {	/* e.g. colors */
+			scr_lose(sc, L_ATTR);
+			return;
+		}
+	}
+	sc->sc_attr = attr;
+}
+
+/* control sequence introducer */
+void scr_csi(struct screen *sc, int final)
+{
+	int p0 = sc->sc_p[0], n = MAX(p0, 1), row = sc->sc_row;
+	int col = sc->sc_col, top, bot;
+
+	if (sc->sc_priv) {
+		scr_lose(sc, L_ALL);
+		return;
+	}
+
+	/* which need the cursor's position? */
+	switch (final) {
+	    case '@':
+	    case 'P':
+	    case 'X':
+		if (row < 0 || col < 0) {
+			scr_lose(sc, L_CELLS);
+			return;
+		}
+		break;
+
+	    case 'J':
+	    case 'K':
+		if (p0 != 2 && (row < 0 || col < 0) ||
+		    final == 'K' && row < 0) {
+			scr_lose(sc, L_CELLS);
+			return;
+		}
+		break;
+
+	    case 'L':
+	    case 'M':
+		if (row < 0 || sc->sc_top < 0) {
+			scr_lose(sc, L_CELLS);
+			return;
+		}
+		break;
+
+	    case 'S':
+	    case 'T':
+		if (sc->sc_top < 0 || sc->sc_np > 0) {	/* CSI T;...: mouse */
+			scr_lose(sc, L_ALL);
+			return;
+		}
+		break;
+
+	    case 'H':
+	    case 'f':
+	    case 'd':
+		if (MIN(p0 ? p0 : 1, sc->sc_xrows) > sc->sc_lines) {
+			scr_lose(sc, L_CURSOR);
+			return;
+		}
+		break;
+
+	    case 'r':
+		top = p0 ? p0 - 1 : 0;
+		bot = sc->sc_np > 0 && sc->sc_p[1] ? sc->sc_p[1] - 1 :
+						     sc->sc_xrows - 1;
+		if (top >= bot || bot >= sc->sc_xrows)	/* ignored */
+			return;
+		if (bot >= sc->sc_lines) {
+			scr_lose(sc, L_REGION | L_CURSOR);
+			return;
+		}
+		break;
+	}
+
+	switch (final) {
+	    case '@':		/* insert characters */
+		n = MIN(n, sc->sc_cols - col);
+		if (sc->sc_known) {
+			memmove(CELL(sc, row, col + n), CELL(sc, row, col),
+				(sc->sc_cols - col - n) * sizeof (unsigned));
+			scr_erase(sc, row, col, n);
+		}
+		break;
+
+	    case 'P':		/* delete characters */
+		n = MIN(n, sc->sc_cols - col);
+		if (sc->sc_known) {
+			memmove(CELL(sc, row, col), CELL(sc, row, col + n),
+				(sc->sc_cols - col - n) * sizeof (unsigned));
+			scr_erase(sc, row, sc->sc_cols - n, n);
+		}
+		break;
+
+	    case 'X':		/* erase characters */
+		scr_erase(sc, row, col, MIN(n, sc->sc_cols - col));
+		break;
+
+	    case 'A':		/* up */
+		if (row >= 0)
+			sc->sc_row = MAX(row - n, row >= sc->sc_top &&
+						  sc->sc_top >= 0 ?
+						  sc->sc_top : 0);
+		break;
+
+	    case 'B':		/* down */
+		if (row < 0)
+			break;
+		if (sc->sc_top >= 0 && row <= sc->sc_bot)
+			sc->sc_row = MIN(row + n, sc->sc_bot);
+		else if (row + n < sc->sc_lines)
+			sc->sc_row = row + n;
+		else if (sc->sc_xrows > sc->sc_lines || sc->sc_top < 0)
+			scr_lose(sc, L_ROW);
+		else
+			sc->sc_row = sc->sc_lines - 1;
+		break;
+
+	    case 'C':		/* right */
+		if (col >= 0)
+			sc->sc_col = MIN(col + n, sc->sc_cols - 1);
+		break;
+
+	    case 'D':		/* left */
+		if (col >= 0)
+			sc->sc_col = MAX(col - n, 0);
+		break;
+
+	    case 'G':		/* to column */
+		sc->sc_col = MIN(n, sc->sc_cols) - 1;
+		break;
+
+	    case 'H':		/* to row, column */
+	    case 'f':
+		sc->sc_col = MIN(sc->sc_np > 0 ? MAX(sc->sc_p[1], 1) : 1,
+				 sc->sc_cols) - 1;
+		/* FALLTHROUGH */
+	    case 'd':		/* to row */
+		sc->sc_row = MIN(n, sc->sc_xrows) - 1;
+		break;
+
+	    case 'J':		/* erase in display */
+		if (p0 == 2) {
+			scr_fill(sc->sc_cell, sc->sc_lines*sc->sc_cols, SCR_BLANK);
+			sc->sc_known = 1;
+		} else if (p0 == 0)
+			scr_erase(sc, row, col, (sc->sc_lines - row)*sc->sc_cols -
+						col);
+		else if (p0 == 1)
+			scr_erase(sc, 0, 0, row*sc->sc_cols + col + 1);
+		break;
+
+	    case 'K':		/* erase in line */
+		if (p0 == 2)
+			scr_erase(sc, row, 0, sc->sc_cols);
+		else if (p0 == 0)
+			scr_erase(sc, row, col, sc->sc_cols - col);
+		else if (p0 == 1)
+			scr_erase(sc, row, 0, col + 1);
+		break;
+
+	    case 'L':		/* insert lines */
+	    case 'M':		/* delete lines */
+		if (row >= sc->sc_top && row <= sc->sc_bot)
+			scr_scroll(sc, row, sc->sc_bot, final == 'L' ? -n : n);
+		break;
+
+	    case 'S':		/* scroll up */
+		scr_scroll(sc, sc->sc_top, sc->sc_bot, n);
+		break;
+
+	    case 'T':		/* scroll down */
+		scr_scroll(sc, sc->sc_top, sc->sc_bot, -n);
+		break;
+
+	    case 'Z':		/* back tab */
+		if (col >= 0)
+			sc->sc_col = MAX(((col + 7) & ~7) - 8*n, 0);
+		break;
+
+	    case 'm':
+		scr_sgr(sc);
+		break;
+
+	    case 'r':		/* scroll region, cursor home */
+		sc->sc_top = top;
+		sc->sc_bot = bot;
+		sc->sc_row = sc->sc_col = 0;
+		break;
+
+	    case 'h':
+	    case 'l':
+		if (sc->sc_np > 0 || p0 != 4) {
+			scr_lose(sc, L_ALL);
+			return;
+		}
+		sc->sc_ins = final == 'h';
+		break;
+
+	    default:
+		scr_lose(sc, L_ALL);
+		return;
+	}
+	sc->sc_wrap = 0;
+}
+
+/* ESC and one character */
+void scr_esc(struct screen *sc, int c)
+{
+	switch (c) {
+	    case '7':		/* save cursor */
+		if (sc->sc_row < 0 || sc->sc_col < 0 || sc->sc_attr < 0)
+			sc->sc_saved = -1;
+		else {
+			sc->sc_saved = 1;
+			sc->sc_srow = sc->sc_row;
+			sc->sc_scol = sc->sc_col;
+			sc->sc_sattr = sc->sc_attr;
+		}
+		break;
+
+	    case '8':		/* restore cursor */
+		if (sc->sc_saved < 0) {
+			scr_lose(sc, L_CURSOR | L_ATTR);
+			break;
+		}
+		sc->sc_wrap = 0;
+		sc->sc_row = sc->sc_saved ? sc->sc_srow : 0;
+		sc->sc_col = sc->sc_saved ? sc->sc_scol : 0;
+		sc->sc_attr = sc->sc_saved ? sc->sc_sattr : 0;
+		break;
+
+	    case 'D':		/* index */
+		scr_index(sc);
+		break;
+
+	    case 'E':		/* next line */
+		sc->sc_col = 0;
+		scr_index(sc);
+		break;
+
+	    case 'M':		/* reverse index */
+		scr_rindex(sc);
+		break;
+
+	    case '\\':		/* string terminator */
+		break;
+
+	    default:
+		scr_lose(sc, L_ALL);
+		break;
+	}
+}
+
+/* is the UTF-8 in sc_seq one column wide? */
+unsigned scr_utf8(struct screen *sc)
+{
+	unsigned char *s = sc->sc_seq;
+	unsigned u;
+
+	if (sc->sc_seqlen == 2) {
+		u = (s[0] & 0x1f) << 6 | (s[1] & 0x3f);
+		if (u < 0xa0 || u >= 0x300 && u < 0x370)  /* C1, combining */
+			return 0;
+		return s[0] | s[1] << 8;
+	}
+	u = (s[0] & 0x0f) << 12 | (s[1] & 0x3f) << 6 | (s[2] & 0x3f);
+	if (u < 0x2010 || u >= 0x2c00 || u >= 0x2028 && u < 0x2030 ||
+	    u >= 0x205f && u < 0x2070)	   /* e.g. CJK, zero-width */
+		return 0;
+	return s[0] | s[1] << 8 | s[2] << 16;
+}
+
+/*
+ * Follow n bytes of output.  If sc_stop is set, return as soon as a
+ * control sequence loses track of the screen, leaving it in sc_seq and
+ * what it lost in sc_lost, without changing the screen; return how many
+ * bytes were consumed.
+ */
+int scr_feed(struct screen *sc, unsigned char *s, int n)
+{
+	unsigned ch;
+	int i, c;
+
+	for (i = 0; i < n; i++) {
+		c = s[i];
+		if (sc->sc_st == SS_GROUND)
+			sc->sc_seqlen = 0;
+		if (sc->sc_st != SS_OSC && sc->sc_st != SS_OSC_ESC) {
+			if (sc->sc_seqlen == SEQ_MAX) {	/* too long */
+				sc->sc_st = SS_GROUND;
+				scr_lose(sc, L_ALL);
+				if (sc->sc_lost)
+					return i;
+				sc->sc_seqlen = 0;
+			}
+			sc->sc_seq[sc->sc_seqlen++] = c;
+		}
+
+		switch (sc->sc_st) {
+		    case SS_GROUND:
+			if (c >= ' ' && c < 0177)
+				scr_print(sc, c);
+			else if (c == 033)
+				sc->sc_st = SS_ESC;
+			else if (c >= 0xc2 && c < 0xf0) {
+				sc->sc_utf8 = c < 0xe0 ? 1 : 2;
+				sc->sc_st = SS_UTF8;
+			} else if (c < ' ' || c == 0177)
+				scr_ctrl(sc, c);
+			else
+				scr_lose(sc, L_ALL);
+			break;
+
+		    case SS_UTF8:
+			if ((c & 0xc0) != 0x80) {
+				sc->sc_st = SS_GROUND;
+				scr_lose(sc, L_ALL);
+			} else if (--sc->sc_utf8 == 0) {
+				sc->sc_st = SS_GROUND;
+				if (ch = scr_utf8(sc))
+					scr_print(sc, ch);
+				else
+					scr_lose(sc, L_ALL);
+			}
+			break;
+
+		    case SS_ESC:
+			sc->sc_st = SS_GROUND;
+			if (c == '[') {
+				sc->sc_st = SS_CSI;
+				sc->sc_priv = 0;
+				sc->sc_np = 0;
+				sc->sc_p[0] = 0;
+			} else if (c == ']')
+				sc->sc_st = SS_OSC;
+			else
+				scr_esc(sc, c);
+			break;
+
+		    case SS_CSI:
+			if (c >= '0' && c <= '9') {
+				if (sc->sc_p[sc->sc_np] < 10000)
+					sc->sc_p[sc->sc_np] =
+						sc->sc_p[sc->sc_np]*10 + c-'0';
+			} else if (c == ';') {
+				if (sc->sc_np == NPARAM - 1) {
+					sc->sc_st = SS_GROUND;
+					scr_lose(sc, L_ALL);
+				} else
+					sc->sc_p[++sc->sc_np] = 0;
+			} else if (c >= '<' && c <= '?')
+				sc->sc_priv = 1;
+			else if (c >= '@' && c <= '~') {
+				sc->sc_st = SS_GROUND;
+				scr_csi(sc, c);
+			} else {	/* intermediate or control */
+				sc->sc_st = SS_GROUND;
+				scr_lose(sc, L_ALL);
+			}
+			break;
+
+		    case SS_OSC:	/* e.g. a window title, doesn't print */
+			if (c == '\a')
+				sc->sc_st = SS_GROUND;
+			else if (c == 033)
+				sc->sc_st = SS_OSC_ESC;
+			break;
+
+		    case SS_OSC_ESC:
+			sc->sc_st = c == '\\' ? SS_GROUND : SS_OSC;
+			break;
+		}
+		if (sc->sc_lost)
+			return i + 1;
+	}
+	return n;
+}
+
+
+/* repaint output */
+void rp_flush(void)
+{
+	write_user(rbuf, rlen);
+	rlen = 0;
+}
+
+/* make room for n chars, and sprintf's NUL */
+void rp_room(int n)
+{
+	if (rlen + n >= sizeof rbuf)
+		rp_flush();
+}
+
+void rp_goto(int row, int col)
+{
+	rp_room(16);
+	rlen += sprintf(rbuf + rlen, "\e[%d;%dH", row + 1, col + 1);
+}
+
+void rp_attr(int attr)
+{
+	static const char codes[] = "124578";
+	int i;
+
+	rp_room(16);
+	rbuf[rlen++] = '\e';
+	rbuf[rlen++] = '[';
+	rbuf[rlen++] = '0';
+	for (i = 0; codes[i]; i++) {
+		if (attr & 1 << i) {
+			rbuf[rlen++] = ';';
+			rbuf[rlen++] = codes[i];
+		}
+	}
+	rbuf[rlen++] = 'm';
+}
+
+void rp_cell(unsigned cell)
+{
+	int i;
+
+	rp_room(3);
+	for (i = 0; i < 3 && (cell >> 8*i & 0xff); i++)
+		rbuf[rlen++] = cell >> 8*i;
+}
+
+/* put the cursor and attributes where sc has them, from attributes a */
+void rp_cursor(struct screen *sc, int a)
+{
+	unsigned *cp;
+
+	/* to get autowrap pending, print the last column again */
+	if (sc->sc_wrap) {
+		cp = CELL(sc, sc->sc_row, sc->sc_cols - 1);
+		rp_goto(sc->sc_row, sc->sc_cols - 1);
+		rp_attr(a = *cp >> 24);
+		rp_cell(*cp);
+	} else
+		rp_goto(sc->sc_row, sc->sc_col);
+	if (a != sc->sc_attr)
+		rp_attr(sc->sc_attr);
+}
+
+/*
+ * Bring the user's terminal from e's scr_shown up to its scr_cur, which
+ * is complete, writing only the cells that differ.
+ */
+int scr_repaint(struct emu *e)
+{
+	struct screen *from = &e->scr_shown, *to = &e->scr_cur;
+	int full = scr_full, row, col, end, r = -1, c = -1, a = -1;
+	unsigned *fp, *tp;
+
+	scr_due = 0;
+	scr_full = 0;
+	rlen = 0;
+
+	if (full || from->sc_ins != 0) {
+		rp_room(4);
+		rlen += sprintf(rbuf + rlen, "\e[4l");
+	}
+	if (full || from->sc_top != to->sc_top || from->sc_bot != to->sc_bot) {
+		rp_room(16);
+		rlen += sprintf(rbuf + rlen, "\e[%d;%dr", to->sc_top + 1,
+				to->sc_bot + 1);
+		r = c = 0;
+	}
+	if (to->sc_saved > 0 && (full || from->sc_saved <= 0 ||
+				 from->sc_srow != to->sc_srow ||
+				 from->sc_scol != to->sc_scol ||
+				 from->sc_sattr != to->sc_sattr)) {
+		rp_goto(to->sc_srow, to->sc_scol);
+		rp_attr(a = to->sc_sattr);
+		rp_room(2);
+		rlen += sprintf(rbuf + rlen, "\e7");
+		r = to->sc_srow;
+		c = to->sc_scol;
+	}
+
+	for (row = 0; row < to->sc_lines; row++) {
+		tp = CELL(to, row, 0);
+		fp = CELL(from, row, 0);
+		for (end = to->sc_cols; end > 0 && tp[end-1] == SCR_BLANK; end--)
+			;
+		for (col = 0; col < to->sc_cols; col++) {
+			if (!full && tp[col] == fp[col])
+				continue;
+			if (col >= end) {	/* the rest is blank */
+				rp_goto(row, col);
+				if (a != 0)
+					rp_attr(a = 0);
+				rp_room(3);
+				rlen += sprintf(rbuf + rlen, "\e[K");
+				r = c = -1;
+				break;
+			}
+			if (r != row || c != col)
+				rp_goto(r = row, c = col);
+			if (a != tp[col] >> 24)
+				rp_attr(a = tp[col] >> 24);
+			rp_cell(tp[col]);
+			if (++c == to->sc_cols)	/* autowrap pending */
+				c = -1;
+		}
+	}
+
+	rp_cursor(to, a);
+	if (to->sc_ins) {
+		rp_room(4);
+		rlen += sprintf(rbuf + rlen, "\e[4h");
+	}
+	return write_user(rbuf, rlen);
+}
+
+
+/*
+ * Show the virtual screen on the user's terminal, just cleared, e.g. when
+ * switching sessions.  What isn't known of it is shown blank, and from
+ * then on is taken to be.
+ */
+int scr_show(void)
+{
+	struct screen *sc = &emu_cur->scr_cur;
+	unsigned *cp;
+	int n = sc->sc_lines * sc->sc_cols;
+
+	if (!sc->sc_known)
+		scr_fill(sc->sc_cell, n, SCR_BLANK);
+	for (cp = sc->sc_cell; cp < sc->sc_cell + n; cp++)
+		if (*cp == SCR_UNKNOWN)
+			*cp = SCR_BLANK;
+	sc->sc_known = 1;
+	if (sc->sc_row < 0 || sc->sc_col < 0) {
+		sc->sc_row = sc->sc_col = 0;
+		sc->sc_wrap = 0;
+	}
+	if (sc->sc_attr < 0)
+		sc->sc_attr = 0;
+	if (sc->sc_top < 0) {
+		sc->sc_top = 0;
+		sc->sc_bot = sc->sc_lines - 1;
+	}
+	if (sc->sc_ins < 0)
+		sc->sc_ins = 0;
+	if (sc->sc_saved < 0)
+		sc->sc_saved = 0;
+	sc->sc_modes = 1;
+	scr_full = 1;
+	return scr_repaint(emu_cur);
+}
+
+/*
+ * Predictive echo (-p): at a slow rate, a key takes a char time or more
+ * to echo.  A printable key is drawn right away, underlined, where its
+ * echo should land: at the cursor, after any keys still awaiting theirs.
+ * When output moves the cursor past a prediction, or writes over it, the
+ * cell either holds the key (confirmed) or not (wrong).  If a prediction
+ * is wrong or its echo is overdue, all of them are taken back, and no
+ * more are shown until an echo is seen again.  Since any other key, e.g.
+ * a CR, may lead to a password prompt, it also stops predictions from
+ * being shown; the next ones are only checked against the echo.
+ *
+ * The user's cursor is left after the predictions, and put back where
+ * the output left it before more is written.
+ */
+
+/* can the user's cursor be put back where the output left it? */
+int pe_ready(struct screen *sc)
+{
+	return sc->sc_st == SS_GROUND && sc->sc_row >= 0 &&
+	       sc->sc_col >= 0 && sc->sc_attr >= 0 &&
+	       (sc->sc_known || !sc->sc_wrap);
+}
+
+/* draw the predictions that are shown, leave the cursor after them */
+int pe_draw(void)
+{
+	struct screen *sc = &emu_cur->scr_cur;
+	struct predict *p;
+	int c = -1;
+
+	rlen = 0;
+	for (p = pe; p < pe + pe_n; p++) {
+		if (!p->pe_shown)
+			continue;
+		if (c != p->pe_col) {
+			rp_goto(p->pe_row, p->pe_col);
+			rp_attr(sc->sc_attr | AT_UNDER);
+		}
+		rp_cell(p->pe_ch);
+		c = p->pe_col + 1;
+	}
+	if (!rlen)
+		return 0;
+	rp_attr(sc->sc_attr);
+	pe_moved = 1;
+	return write_user(rbuf, rlen);
+}
+
+/* take back all predictions, redrawing the cells they cover */
+int pe_clear(void)
+{
+	struct screen *sc = &emu_cur->scr_cur;
+	struct predict *p;
+	unsigned cell;
+
+	rlen = 0;
+	if (pe_ready(sc)) {
+		for (p = pe; p < pe + pe_n; p++) {
+			cell = *CELL(sc, p->pe_row, p->pe_col);
+			if (!p->pe_shown || cell == SCR_UNKNOWN)
+				continue;
+			rp_goto(p->pe_row, p->pe_col);
+			rp_attr(cell >> 24);
+			rp_cell(cell);
+		}
+		if (rlen || pe_moved)
+			rp_cursor(sc, rlen ? -1 : sc->sc_attr);
+	}
+	pe_n = 0;
+	pe_moved = 0;
+	return rlen ? write_user(rbuf, rlen) : 0;
+}
+
+/* a prediction was wrong or overdue */
+int pe_fail(void)
+{
+	pe_trust = 0;
+	return pe_clear();
+}
+
+/* take back all predictions, e.g. when predictive echo is turned off */
+int scr_unpredict(void)
+{
+	return pe_fail();
+}
+
+/*
+ * Predict the echo of key c, which is written to the child after in_ns
+ * nanoseconds (if input is paced).
+ */
+int scr_predict(int c, long long in_ns)
+{
+	struct screen *sc = &emu_cur->scr_cur;
+	struct predict *p;
+	int col;
+
+	if (!pe_n)
+		pe_block = 0;
+	if (c < ' ' || c >= 0177) {
+		pe_trust = 0;
+		pe_block = 1;
+		return 0;
+	}
+	col = pe_n ? pe[pe_n-1].pe_col + 1 : sc->sc_col;
+	if (pe_block || !emu_cur->scr_on || scr_ff ||
+	    !pe_ready(sc) || !sc->sc_known || sc->sc_ins || sc->sc_wrap ||
+	    col >= sc->sc_cols - 1 || pe_n == PE_MAX) {
+		pe_block = 1;	/* can't tell where the next one goes */
+		return 0;
+	}
+
+	p = &pe[pe_n++];
+	p->pe_row = sc->sc_row;
+	p->pe_col = col;
+	p->pe_ch = c;
+	p->pe_under = *CELL(sc, p->pe_row, col);
+	p->pe_shown = pe_trust;
+	p->pe_due = mono_ns() + PE_TIMEOUT_NS + in_ns;
+	if (ocps)	/* behind the paced output, and the other echoes */
+		p->pe_due += (pq_len + pe_n) * 1000000000LL / ocps;
+	return p->pe_shown ? pe_draw() : 0;
+}
+
+/* put the user's cursor back before output is written */
+int pe_restore(void)
+{
+	struct screen *sc = &emu_cur->scr_cur;
+
+	rlen = 0;
+	rp_cursor(sc, sc->sc_attr);
+	pe_moved = 0;
+	return write_user(rbuf, rlen);
+}
+
+/* check the predictions against output just written */
+int scr_echoed(void)
+{
+	struct screen *sc = &emu_cur->scr_cur;
+	struct predict *p;
+	unsigned cell;
+	int n = 0;
+
+	if (!pe_n)
+		return 0;
+	if (!sc->sc_known || sc->sc_row < 0 || sc->sc_col < 0)
+		return pe_fail();
+	for (p = pe; p < pe + pe_n; p++) {
+		cell = *CELL(sc, p->pe_row, p->pe_col);
+		if (p->pe_row == sc->sc_row && p->pe_col >= sc->sc_col &&
+		    cell == p->pe_under) {
+			pe[n++] = *p;	/* not echoed yet */
+			continue;
+		}
+		if ((cell & 0xffffff) != p->pe_ch)
+			return pe_fail();
+		pe_trust = 1;
+	}
+	pe_n = n;
+
+	/* the output may have drawn over them */
+	return pe_ready(sc) ? pe_draw() : 0;
+}
+
+
+/*
+ * Follow output about to be written.  While collapsing, return how many
+ * of its leading bytes went to the virtual screen instead, and so must
+ * not be written, or -1 if a repaint failed.
+ */
+int scr_output(struct emu *e, char *buf, int n)
+{
+	struct screen *sc = &e->scr_cur;
+	unsigned char *s = (unsigned char *)buf;
+	int k;
+
+	if (!n)
+		return 0;
+	if (out_hidden) {		/* a background session's */
+		scr_feed(sc, s, n);
+		return n;
+	}
+	if (pe_moved && pe_restore() < 0)
+		return -1;
+	if (!scr_ff || !scr_complete(sc)) {
+		scr_feed(sc, s, n);
+		return 0;
+	}
+	if (!scr_due) {
+		scr_copy(&e->scr_shown, sc);
+		scr_due = mono_ns() + SCR_FRAME_NS;
+	}
+	sc->sc_stop = 1;
+	k = scr_feed(sc, s, n);
+	sc->sc_stop = 0;
+	if (!sc->sc_lost)
+		return n;
+
+	/* lost track: show what was followed, then write the rest as-is */
+	if (scr_repaint(e) < 0 ||
+	    write_user((char *)sc->sc_seq, sc->sc_seqlen) < 0)
+		return -1;
+	scr_apply_loss(sc);
+	scr_feed(sc, s + k, n - k);
+	return k;
+}
+
+/*
+ * Start or stop collapsing output, taking back any predictions first;
+ * return -1 if a repaint failed.
+ */
+int scr_collapse(int on)
+{
+	int rv = scr_unpredict();
+
+	if (on) {
+		scr_ff = emu_cur->scr_on;
+		scr_full = 1;	/* in case of writes it didn't follow */
+		return rv;
+	}
+	if (scr_due && scr_repaint(emu_cur) < 0)
+		rv = -1;
+	scr_ff = 0;
+	return rv;
+}
+
+/* return nanoseconds until a repaint or an echo is due, or -1 if none */
+long long scr_wait(void)
+{
+	long long now, due = scr_due;
+
+	if (pe_n && (!due || pe[0].pe_due < due))
+		due = pe[0].pe_due;
+	if (!due)
+		return -1;
+	now = mono_ns();
+	return due > now ? due - now : 0;
+}
+
+/* repaint if it's due, take back predictions whose echo is overdue */
+int scr_check(void)
+{
+	long long now;
+
+	if (!scr_due && !pe_n)
+		return 0;
+	now = mono_ns();
+	if (pe_n && pe[0].pe_due <= now && pe_fail() < 0)
+		return -1;
+	return scr_due && scr_due <= now ? scr_repaint(emu_cur) : 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Virtual screen of the emulated terminal, for collapsing output.
+ */
+
+#ifndef _SCREEN_H
+#define _SCREEN_H 1
+
+#define SEQ_MAX		32		/* longest control sequence followed */
+#define NPARAM		8		/* most CSI parameters followed */
+
+enum scr_state { SS_GROUND = 0, SS_ESC, SS_CSI, SS_OSC, SS_OSC_ESC, SS_UTF8 };
+
+struct screen {
+	unsigned	*sc_cell;	/* sc_lines * sc_cols */
+	int		sc_lines, sc_cols;
+	int		sc_xrows;	/* user's screen */
+	int		sc_am;		/* autowrap */
+	int		sc_known;	/* all cells known */
+	int		sc_row, sc_col;	/* cursor, < 0 if unknown */
+	int		sc_wrap;	/* autowrap pending at right margin */
+	int		sc_attr;	/* SGR attributes, < 0 if unknown */
+	int		sc_top, sc_bot;	/* scroll region, top < 0 if unknown */
+	int		sc_ins;		/* insert mode, < 0 if unknown */
+	int		sc_modes;	/* no other mode changed */
+	int		sc_saved;	/* ESC 7: 1 = saved, 0 = not, < 0 = ? */
+	int		sc_srow, sc_scol, sc_sattr;
+
+	enum scr_state	sc_st;		/* parser state */
+	unsigned char	sc_seq[SEQ_MAX]; /* control sequence so far */
+	int		sc_seqlen;
+	int		sc_utf8;	/* UTF-8 continuation bytes wanted */
+	int		sc_priv;	/* CSI private parameters */
+	int		sc_np, sc_p[NPARAM];
+	int		sc_stop;	/* stop following at the first loss */
+	int		sc_lost;	/* ... which lost these */
+};
+
+struct emu;
+
+extern int scr_ff, scr_keep, predict_echo;
+
+extern void scr_start(struct emu *e, int known);
+extern int scr_output(struct emu *e, char *buf, int n);
+extern int scr_collapse(int on);
+extern long long scr_wait(void);
+extern int scr_check(void);
+extern int scr_predict(int c, long long in_ns);
+extern int scr_echoed(void);
+extern int scr_unpredict(void);
+extern int scr_show(void);
+
+#endif /* _SCREEN_H */
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Binary trace of output translation, kept in a ring in memory with -ddd
+ * and written to a file by ~t or SIGUSR1.  Decode it with emutrace.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H 1
+
+#define TRACE_SIZE	65536		/* records in ring, power of 2 */
+#define TRACE_MAGIC	"EMUTRC1\n"
+#define TRACE_FILE	"emuterm.trace"	/* default for ~t and SIGUSR1 */
+
+/* one record per byte of output from the slave */
+struct trace {
+	long long	tr_ns;		/* mono_ns() of the read */
+	unsigned char	tr_c;		/* byte, parity stripped */
+	unsigned char	tr_action;	/* enum action taken */
+	char		tr_cap[2];	/* capability, if any */
+	unsigned short	tr_arg[2];	/* args parsed so far */
+};
+
+/* file: TRACE_MAGIC, then records oldest first */
+
+extern struct trace *tring;
+extern unsigned tnext;		/* records ever added */
+
+extern int dump_trace(char *path);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,620 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * With -u, the event loop's I/O goes through an io_uring, by raw syscalls,
+ * so that a burst of output costs about one io_uring_enter() rather than
+ * a poll, a read, a write to the recording and writes to the user:
+ *
+ * - The master is read by a multishot read into a ring of provided
+ *   buffers, and the reads are kept, whole, until ur_read() takes them.
+ *   (Not while pacing, which reads only as needed, by read().)
+ * - Output to the user and the recording is queued, and written by
+ *   one write in flight per fd, submitted with the next wait.
+ * - ur_poll() stands in for ep_poll(): the other fds are watched by
+ *   one-shot polls, rearmed as they fire, so they act like poll().
+ *
+ * If the kernel can't do this, the event loop uses epoll as before; if
+ * it can't do multishot reads, the master is polled and read().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include "emuterm.h"
+#include "output.h"
+#include "uring.h"
+
+
+#define UR_ENTRIES	64		/* submission queue entries */
+#define UR_NBUFS	8		/* buffers for reads, power of 2 */
+#define UR_CHUNK	65536		/* min bytes per queued write chunk */
+#define UR_NQ		2		/* write queues: user, recording */
+#define UR_NSLOTS	8		/* pfds[] that can be polled */
+#define UR_IOV		16		/* chunks per write */
+
+#define UR_OP_READ_MULTISHOT	49	/* not in older headers */
+
+/* each request's user_data: what it's for, a generation, and an index */
+enum { UR_IGNORE, UR_POLL, UR_READ, UR_WRITE, UR_WRITABLE };
+#define UR_DATA(kind, gen, i) \
+	((unsigned long long)(kind) << 32 | ((gen) & 0xffffff) << 8 | (i))
+
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int ur_mode = 0;		/* -u */
+int ur_on = 0;			/* ...and the kernel can do it */
+
+int ur_fd = -1;
+unsigned *sq_head, *sq_tail, sq_mask, sq_next;
+struct io_uring_sqe *sqes;
+unsigned *cq_head, *cq_tail, cq_mask;
+struct io_uring_cqe *cqes;
+
+/* one-shot polls for pfds[] */
+int ur_pfd[UR_NSLOTS];		/* fd polled */
+short ur_armed[UR_NSLOTS];	/* events of the poll in flight, or 0 */
+unsigned ur_gen[UR_NSLOTS];	/* completions of older polls are stale */
+short ur_rev[UR_NSLOTS];	/* events seen, not yet reported */
+
+/* multishot read of the master, and the reads not yet taken */
+int ur_mshot = 0, ur_rfd = -1, ur_bufsz;
+enum { RD_OFF, RD_ARMED, RD_CANCEL } ur_rd = RD_OFF;
+struct io_uring_buf_ring *ur_br;
+char *ur_bufs;
+unsigned short ur_brtail;
+int ur_nfree;			/* buffers in ur_br */
+struct { int bid, res; } ur_stash[UR_NBUFS+1];
+int ur_sfirst = 0, ur_sn = 0;
+
+/* queued writes, one in flight per fd */
+struct urchunk {
+	struct urchunk	*uc_next;
+	int		uc_off, uc_len, uc_size;
+	char		uc_data[];
+};
+
+struct urq {
+	int		q_fd;
+	struct urchunk	*q_head, *q_tail;
+	long		q_len;
+	int		q_busy;		/* a write or poll is in flight */
+	int		q_err;		/* errno of a failed write */
+	struct iovec	q_iov[UR_IOV];	/* the chunks being written */
+} ur_q[UR_NQ] = { { -1 }, { -1 } };
+
+
+int ur_enter(unsigned min, unsigned flags, struct timespec *ts)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec kts;
+
+	memset(&arg, 0, sizeof arg);
+	arg.sigmask_sz = _NSIG / 8;
+	if (ts) {
+		kts.tv_sec = ts->tv_sec;
+		kts.tv_nsec = ts->tv_nsec;
+		arg.ts = (unsigned long)&kts;
+	}
+	STORE(sq_tail, sq_next);
+	return syscall(__NR_io_uring_enter, ur_fd, sq_next - LOAD(sq_head),
+		       min, flags | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+/* next free submission, submitting those queued if it's full */
+struct io_uring_sqe *ur_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	while (sq_next - LOAD(sq_head) > sq_mask) {
+		if (ur_enter(0, 0, NULL) < 0 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY)
+			break;
+	}
+	sqe = &sqes[sq_next++ & sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+void ur_poll_add(int i, int fd, short events)
+{
+	struct io_uring_sqe *sqe = ur_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = UR_DATA(UR_POLL, ur_gen[i], i);
+}
+
+void ur_cancel(int op, unsigned long long data)
+{
+	struct io_uring_sqe *sqe = ur_sqe();
+
+	sqe->opcode = op;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = UR_DATA(UR_IGNORE, 0, 0);
+}
+
+
+/* give buffer bid back to the kernel for reads */
+void ur_recycle(int bid)
+{
+	struct io_uring_buf *b = &ur_br->bufs[ur_brtail & (UR_NBUFS-1)];
+
+	b->addr = (unsigned long)(ur_bufs + bid * ur_bufsz);
+	b->len = ur_bufsz;
+	b->bid = bid;
+	STORE(&ur_br->tail, ++ur_brtail);
+	ur_nfree++;
+}
+
+void ur_read_arm(void)
+{
+	struct io_uring_sqe *sqe = ur_sqe();
+
+	sqe->opcode = UR_OP_READ_MULTISHOT;
+	sqe->fd = ur_rfd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = UR_DATA(UR_READ, 0, 0);
+	ur_rd = RD_ARMED;
+}
+
+void ur_read_done(struct io_uring_cqe *cqe)
+{
+	int bid = -1, i;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		ur_nfree--;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ur_rd = RD_OFF;
+
+	/* out of buffers, or canceled: rearmed when wanted */
+	if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+		if (bid >= 0)
+			ur_recycle(bid);
+		return;
+	}
+	i = (ur_sfirst + ur_sn++) % (UR_NBUFS+1);
+	ur_stash[i].bid = bid;
+	ur_stash[i].res = cqe->res;
+}
+
+
+/* write what's queued for q in one request, if nothing is in flight */
+void ur_qwrite(struct urq *q)
+{
+	struct io_uring_sqe *sqe;
+	struct urchunk *uc;
+	int n;
+
+	if (q->q_busy || !q->q_head)
+		return;
+	for (n = 0, uc = q->q_head; uc && n < UR_IOV; uc = uc->uc_next, n++) {
+		q->q_iov[n].iov_base = uc->uc_data + uc->uc_off;
+		q->q_iov[n].iov_len = uc->uc_len - uc->uc_off;
+	}
+	sqe = ur_sqe();
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = q->q_fd;
+	sqe->addr = (unsigned long)q->q_iov;
+	sqe->len = n;
+	sqe->off = -1;
+	sqe->user_data = UR_DATA(UR_WRITE, 0, q - ur_q);
+	q->q_busy = 1;
+}
+
+void ur_qfree(struct urq *q)
+{
+	struct urchunk *uc;
+
+	while ((uc = q->q_head)) {
+		q->q_head = uc->uc_next;
+		free(uc);
+	}
+	q->q_tail = NULL;
+	q->q_len = 0;
+}
+
+void ur_wrote(struct urq *q, int res)
+{
+	struct urchunk *uc;
+	struct io_uring_sqe *sqe;
+	int n;
+
+	q->q_busy = 0;
+	if (res == -EAGAIN) {		/* non-blocking tty is full */
+		sqe = ur_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = q->q_fd;
+		sqe->poll32_events = POLLOUT;
+		sqe->user_data = UR_DATA(UR_WRITABLE, 0, q - ur_q);
+		q->q_busy = 1;
+		return;
+	}
+	if (res < 0 && res != -EINTR) {
+		q->q_err = -res;
+		ur_qfree(q);
+		return;
+	}
+	for ( ; res > 0; res -= n) {
+		uc = q->q_head;
+		n = MIN(res, uc->uc_len - uc->uc_off);
+		uc->uc_off += n;
+		q->q_len -= n;
+		if (uc->uc_off == uc->uc_len) {
+			if (!(q->q_head = uc->uc_next))
+				q->q_tail = NULL;
+			free(uc);
+		}
+	}
+	ur_qwrite(q);
+}
+
+
+/* handle what's completed */
+void ur_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head = *cq_head, kind, gen, i;
+
+	for ( ; head != LOAD(cq_tail); head++) {
+		cqe = &cqes[head & cq_mask];
+		kind = cqe->user_data >> 32;
+		gen = cqe->user_data >> 8 & 0xffffff;
+		i = cqe->user_data & 0xff;
+		switch (kind) {
+		    case UR_POLL:
+			if (gen != (ur_gen[i] & 0xffffff))
+				break;		/* since replaced */
+			ur_armed[i] = 0;
+			if (cqe->res > 0)
+				ur_rev[i] |= cqe->res;
+			else if (cqe->res < 0 && cqe->res != -ECANCELED)
+				ur_rev[i] |= POLLERR;
+			break;
+
+		    case UR_READ:
+			ur_read_done(cqe);
+			break;
+
+		    case UR_WRITE:
+			ur_wrote(&ur_q[i], cqe->res);
+			break;
+
+		    case UR_WRITABLE:
+			ur_q[i].q_busy = 0;
+			ur_qwrite(&ur_q[i]);
+			break;
+		}
+	}
+	STORE(cq_head, head);
+}
+
+
+/* set up the ring, return -1 if the kernel can't */
+int ur_init(int mfd, int bufsz)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	struct io_uring_buf_reg reg;
+	unsigned flags[] = { IORING_SETUP_SINGLE_ISSUER |
+			     IORING_SETUP_DEFER_TASKRUN,
+			     IORING_SETUP_COOP_TASKRUN, 0 };
+	size_t sz, psz;
+	char *sq, *cq;
+	int i;
+
+	for (i = 0; i < sizeof flags / sizeof *flags; i++) {
+		memset(&p, 0, sizeof p);
+		p.flags = flags[i];
+		if ((ur_fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p)) >= 0 ||
+		    errno != EINVAL)
+			break;
+	}
+	if (ur_fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	sz = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+		 p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	sq = mmap(NULL, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		  ur_fd, IORING_OFF_SQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ur_fd,
+		    IORING_OFF_SQES);
+	if (sq == MAP_FAILED || sqes == MAP_FAILED)
+		goto fail;
+	cq = sq;
+	sq_head = (unsigned *)(sq + p.sq_off.head);
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	sq_next = *sq_tail;
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned *)(sq + p.sq_off.array))[i] = i;
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	for (i = 0; i < UR_NSLOTS; i++)
+		ur_pfd[i] = -1;
+
+	/* multishot reads need the op, and a ring of buffers */
+	psz = sizeof *probe + 256 * sizeof(struct io_uring_probe_op);
+	if (!(probe = calloc(1, psz)))
+		goto fail;
+	if (syscall(__NR_io_uring_register, ur_fd, IORING_REGISTER_PROBE,
+		    probe, 256) == 0 && probe->last_op >= UR_OP_READ_MULTISHOT &&
+	    (probe->ops[UR_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED)) {
+		ur_br = mmap(NULL, UR_NBUFS * sizeof(struct io_uring_buf),
+			     PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+			     -1, 0);
+		ur_bufs = malloc(UR_NBUFS * bufsz);
+		memset(&reg, 0, sizeof reg);
+		reg.ring_addr = (unsigned long)ur_br;
+		reg.ring_entries = UR_NBUFS;
+		reg.bgid = 0;
+		if (ur_br != MAP_FAILED && ur_bufs &&
+		    syscall(__NR_io_uring_register, ur_fd,
+			    IORING_REGISTER_PBUF_RING, &reg, 1) == 0) {
+			ur_mshot = 1;
+			ur_rfd = mfd;
+			ur_bufsz = bufsz;
+			for (i = 0; i < UR_NBUFS; i++)
+				ur_recycle(i);
+		}
+	}
+	free(probe);
+	return 0;
+
+    fail:
+	close(ur_fd);
+	ur_fd = -1;
+	return -1;
+}
+
+
+/*
+ * Like ep_poll(): submit what's queued, wait for pfds[] or the timeout,
+ * and set revents.  POLLIN on the master means ur_read() has a read.
+ */
+int ur_poll(struct pollfd *pfds, int n, struct timespec *ts)
+{
+	struct timespec zero = { 0, 0 };
+	int i, k, rslot = -1, pending = 0;
+	short ev;
+
+	for (i = 0; i < n && i < UR_NSLOTS; i++) {
+		ev = pfds[i].events;
+		if (pfds[i].fd == ur_rfd && ur_mshot && !ocps) {
+			rslot = i;
+			if ((ev & POLLIN) && ur_sn)
+				pending = 1;
+			if ((ev & POLLIN) && ur_rd == RD_OFF && ur_nfree)
+				ur_read_arm();
+			else if (!(ev & POLLIN) && ur_rd == RD_ARMED) {
+				ur_cancel(IORING_OP_ASYNC_CANCEL,
+					  UR_DATA(UR_READ, 0, 0));
+				ur_rd = RD_CANCEL;
+			}
+			ev &= ~POLLIN;
+		}
+		if (ur_armed[i] && (ev != ur_armed[i] ||
+				    pfds[i].fd != ur_pfd[i])) {
+			ur_cancel(IORING_OP_POLL_REMOVE,
+				  UR_DATA(UR_POLL, ur_gen[i], i));
+			ur_gen[i]++;
+			ur_armed[i] = 0;
+		}
+		if (ev && !ur_armed[i]) {
+			ur_poll_add(i, pfds[i].fd, ev);
+			ur_pfd[i] = pfds[i].fd;
+			ur_armed[i] = ev;
+		}
+		if (ur_rev[i] & (ev | POLLERR|POLLHUP|POLLNVAL))
+			pending = 1;
+	}
+
+	k = ur_enter(pending ? 0 : 1, IORING_ENTER_GETEVENTS,
+		     pending ? &zero : ts);
+	if (k < 0 && errno != ETIME && errno != EBUSY)
+		return -1;
+	ur_reap();
+
+	for (i = k = 0; i < n; i++) {
+		pfds[i].revents = i >= UR_NSLOTS ? 0 : ur_rev[i] &
+			(pfds[i].events | POLLERR|POLLHUP|POLLNVAL);
+		if (i < UR_NSLOTS)
+			ur_rev[i] = 0;
+		if (i == rslot && ur_sn && (pfds[i].events & POLLIN))
+			pfds[i].revents |= POLLIN;
+		if (pfds[i].revents)
+			k++;
+	}
+	return k;
+}
+
+/*
+ * Like read() of the master, but takes the next whole read done by the
+ * multishot read, if any; size is then ignored (bufsz of ur_init() is
+ * enough).  While it's running, there's nothing to read until it has.
+ */
+int ur_read(int fd, char *buf, int size)
+{
+	int bid, res;
+
+	ur_reap();
+	if (ur_sn) {
+		bid = ur_stash[ur_sfirst].bid;
+		res = ur_stash[ur_sfirst].res;
+		ur_sfirst = (ur_sfirst + 1) % (UR_NBUFS+1);
+		ur_sn--;
+		if (res > 0)
+			memcpy(buf, ur_bufs + bid * ur_bufsz, res);
+		if (bid >= 0)
+			ur_recycle(bid);
+		if (res < 0) {
+			errno = -res;
+			return -1;
+		}
+		return res;
+	}
+	if (ur_rd != RD_OFF) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return read(fd, buf, size);
+}
+
+/* stop the multishot read, so what's left can be read by ur_read() now */
+void ur_unread(void)
+{
+	if (ur_rd == RD_ARMED) {
+		ur_cancel(IORING_OP_ASYNC_CANCEL, UR_DATA(UR_READ, 0, 0));
+		ur_rd = RD_CANCEL;
+	}
+	while (ur_rd != RD_OFF) {
+		if (ur_enter(1, IORING_ENTER_GETEVENTS, NULL) < 0 &&
+		    errno != EINTR && errno != EBUSY)
+			break;
+		ur_reap();
+	}
+}
+
+/* discard the reads not yet taken, as the child's tty flushed its output */
+void ur_discard(void)
+{
+	for ( ; ur_sn; ur_sn--) {
+		if (ur_stash[ur_sfirst].bid >= 0)
+			ur_recycle(ur_stash[ur_sfirst].bid);
+		ur_sfirst = (ur_sfirst + 1) % (UR_NBUFS+1);
+	}
+}
+
+
+struct urq *ur_findq(int fd)
+{
+	int i;
+
+	for (i = 0; i < UR_NQ; i++) {
+		if (ur_q[i].q_fd == fd)
+			return &ur_q[i];
+	}
+	return NULL;
+}
+
+/* queue buf to be written to fd (the user or the recording) */
+int ur_write(int fd, char *buf, int len)
+{
+	struct urq *q;
+	struct urchunk *uc;
+	int n;
+
+	if (!(q = ur_findq(fd))) {
+		if (!(q = ur_findq(-1))) {
+			errno = EMFILE;
+			return -1;
+		}
+		q->q_fd = fd;
+		q->q_err = 0;
+	}
+	if (q->q_err) {
+		errno = q->q_err;
+		return -1;
+	}
+	for ( ; len > 0; buf += n, len -= n) {
+		if (!(uc = q->q_tail) || uc->uc_len == uc->uc_size) {
+			n = MAX(len, UR_CHUNK);
+			if (!(uc = malloc(sizeof *uc + n)))
+				return -1;
+			uc->uc_next = NULL;
+			uc->uc_off = uc->uc_len = 0;
+			uc->uc_size = n;
+			if (q->q_tail)
+				q->q_tail->uc_next = uc;
+			else
+				q->q_head = uc;
+			q->q_tail = uc;
+		}
+		n = MIN(len, uc->uc_size - uc->uc_len);
+		memcpy(uc->uc_data + uc->uc_len, buf, n);
+		uc->uc_len += n;
+		q->q_len += n;
+	}
+	ur_qwrite(q);
+	return 0;
+}
+
+/* bytes queued for fd */
+long ur_queued(int fd)
+{
+	struct urq *q = ur_findq(fd);
+
+	return q ? q->q_len : 0;
+}
+
+/* -1 if a write to fd has failed */
+int ur_error(int fd)
+{
+	struct urq *q = ur_findq(fd);
+
+	if (q && q->q_err) {
+		errno = q->q_err;
+		return -1;
+	}
+	return 0;
+}
+
+/* write all that's queued for fd, and forget it */
+int ur_drain(int fd)
+{
+	struct urq *q = ur_findq(fd);
+	int rv;
+
+	if (!q)
+		return 0;
+	while (q->q_head) {
+		if (ur_enter(1, IORING_ENTER_GETEVENTS, NULL) < 0 &&
+		    errno != EINTR && errno != EBUSY)
+			break;
+		ur_reap();
+	}
+	rv = ur_error(fd);
+	if (!q->q_busy) {
+		ur_qfree(q);
+		q->q_fd = -1;
+	}
+	return rv;
+}
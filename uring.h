@@ -0,0 +1,37 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * io_uring backend for the event loop (-u).
+ */
+
+#ifndef _URING_H
+#define _URING_H 1
+
+extern int ur_mode, ur_on;
+
+extern int ur_init(int mfd, int bufsz);
+extern int ur_poll(struct pollfd *pfds, int n, struct timespec *ts);
+extern int ur_read(int fd, char *buf, int size);
+extern void ur_unread(void);
+extern void ur_discard(void);
+extern int ur_write(int fd, char *buf, int len);
+extern long ur_queued(int fd);
+extern int ur_error(int fd);
+extern int ur_drain(int fd);
+
+#endif /* _URING_H */
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2024, 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Output translator internals, shared by output.c, mkxlate (which
+ * generates specialized translators from the frozen parse table), and
+ * the translators it generates.  Needs output.h and screen.h.
+ */
+
+#ifndef _XLATE_H
+#define _XLATE_H 1
+
+/* parse table for output */
+enum action {
+	AC_IGNORE = 0,		  /* no action (default) */
+	AC_NEXT,		  /* continue to next parse table */
+	AC_PRINT = AC_NEXT+1,	  /* print as-is */
+	AC_FMT,			  /* print constant string */
+	AC_FMT1 = AC_FMT+1,	  /* format string w/1 integer argument */
+	AC_FMT2 = AC_FMT1+1,	  /* format string w/2 integer arguments */
+	AC_FMT2_REV = AC_FMT2+1,  /* AC_FMT2 w/args swapped */
+	AC_LL = AC_FMT2_REV+1,    /* format string w/#lines */
+	AC_STLINE = AC_LL+1,	  /* AC_FMT, optional argument ignored */
+	AC_REGION = AC_STLINE+1,  /* AC_FMT2 w/2 row arguments */
+};
+
+enum state {
+	ST_UNSET = 0,
+	ST_NEXT,		  /* continue to next step */
+	ST_GET_1C,		  /* consume 1 char,   for %. and %+ */
+	ST_GET_DIGITS,		  /* any # of digits,  for %d */
+	ST_GET_3D,		  /* consume 3 digits, for %3 */
+	ST_GET_2D = ST_GET_3D+1,  /* consume 2 digits, for %2 and %3 */
+	ST_GET_1D = ST_GET_2D+1,  /* consume 1 digit,  for %2 and %3 */
+};
+
+struct pentry {
+	struct step {
+		short	    pt_inc;	/* termcap %i or %+X */
+		enum state  pt_initial;
+	} pt_steps[2];			/* arg parsing steps */
+	short		pt_nsteps;
+	char		pt_cap[2];	/* capability that this came from */
+	enum action	pt_action;
+	union {
+		void	*pt_ptr;	/* fmt or next parsetab */
+		unsigned short pt_next;	/* next state, once frozen */
+		struct emit *pt_emit;	/* compiled fmt, once frozen */
+	};
+	struct pentry	*pt_alt;	/* to try if this doesn't match */
+};
+
+struct pstate {
+	unsigned char	ps_class[128];	/* char -> index into entries */
+	unsigned short	ps_base;	/* first entry in pentries */
+	unsigned short	ps_nent;	/* # distinct entries */
+};
+
+#define PENTRY(e, st, c) \
+	((e)->pentries + (e)->pstates[st].ps_base + (e)->pstates[st].ps_class[c])
+
+struct emit {
+	char	*em_rep;		/* original format */
+	short	em_nargs;
+	short	em_len[3];		/* lengths of fragments */
+	char	*em_frag[3];		/* literal text around args */
+};
+
+/*
+ * Where xlate_generic() is between calls: in state st, partway through
+ * the steps of entry pp, with a pending alternative bt (see xlate_pt).
+ */
+#define PEND_MAX	64
+
+struct ptstate {
+	int		st;
+	struct pentry	*pp;
+	int		nump, p[2];	/* arguments so far */
+	enum state	state;
+	int		step;
+	struct pentry	*bt, *alt;
+	int		bt_st, bt_nump, bt_p[2], npend;
+	unsigned char	bt_c, pend[PEND_MAX];
+};
+
+/* control sequence being collected by xlate_vt() */
+#define VT_NPARAM	16		/* more parameters are ignored */
+#define VT_NFINAL	(0x7f - 0x30)	/* final characters '0' to '~' */
+
+struct vtseq {
+	unsigned char	vs_state;	/* enum vt_state */
+	unsigned char	vs_priv;
+	unsigned char	vs_inter;	/* 0xff if more than one */
+	short		vs_nparam;
+	unsigned short	vs_param[VT_NPARAM];
+};
+
+/*
+ * Cache of recently rendered cursor motions (AC_FMT2), indexed by
+ * row and column.  Define CM_CACHE as 0 to disable.
+ */
+#ifndef CM_CACHE
+#define CM_CACHE	64
+#endif
+
+struct cmcache {
+	struct emit	*cc_emit;
+	unsigned short	cc_row, cc_col;
+	unsigned char	cc_len;
+	char		cc_buf[19];
+};
+
+struct emu;
+
+/*
+ * A translator consumes n bytes of output from the slave, appending the
+ * translation to e->obuf.  It returns >= 0, or -1 if a flush failed.
+ */
+typedef int xlate_fn(struct emu *e, unsigned char *buf, int n);
+
+/* specialized translators, generated by mkxlate */
+struct xlate {
+	char		*xl_name;	/* terminal type it was generated for */
+	unsigned long long xl_sig;	/* pt_sig() of that parse table */
+	xlate_fn	*xl_fn;
+};
+
+/*
+ * An emulator context (see emu.h).  The translators, and all they call,
+ * take the context they work on, so contexts are independent.
+ */
+struct emu {
+	/* terminal type, see set_termtype() */
+	int		term_set, term_am, term_hz, term_vt;
+	int		term_cols, term_lines;
+	int		term_cs, term_im;	/* has "cs", "im" */
+	char		*term_arrows[4];	/* up, down, right, left */
+	char		tbuf[2048];		/* termcap entry, see tgetent() */
+	char		cbuf[2048];		/* extracted capability values */
+	char		*cbp;
+
+	/* parse table, see add_parse() and freeze_pt() */
+	struct pentry	*parsetab;		/* tree, while it's built */
+	struct pstate	*pstates;
+	int		npstates;
+	struct pentry	*pentries, *palts;
+	int		npalts;
+	struct emit	**emits;
+	int		nemits;
+	struct vtcand	*vt_cands[2][VT_NFINAL];  /* by kind, final - '0' */
+#if CM_CACHE
+	struct cmcache	cmcache[CM_CACHE];
+#endif
+
+	/* translator, and where it is between calls */
+	xlate_fn	*xlate;
+	unsigned char	print_lo, print_hi;	/* see init_scan_print() */
+	int		(*scan_print)(struct emu *e, unsigned char *s, int n,
+				      char *d);
+	struct ptstate	pts;			/* xlate_generic() */
+	struct vtseq	vt;			/* xlate_vt() */
+	int		xl_pos, xl_p[2];	/* generated by mkxlate */
+
+	/* translated output, see flush_output() */
+	char		obuf[OBUF_SIZE];
+	int		olen;
+	long long	ofirst, olast;		/* when first, last queued */
+	int		(*sink)(char *buf, int len);  /* NULL: the user */
+
+	/* output read from the slave */
+	char		*hbuf;
+	int		hsize;			/* see adapt_rsize() */
+	int		pkt_mode;		/* 1 = on, -1 = unsupported */
+	int		savefd;			/* recording, or -1 */
+
+	/* the ~ command being typed, see handle_input() */
+	char		icmd[512], *icp;
+
+	/* virtual screen, see scr_start() */
+	int		scr_on;
+	struct screen	scr_cur;		/* emulated terminal */
+	struct screen	scr_shown;		/* user's, when last repainted */
+};
+
+extern xlate_fn xlate_none, xlate_generic, xlate_traced, xlate_vt,
+		xlate_vt_traced;
+extern struct xlate xlates[];
+
+extern unsigned long long pt_sig(struct emu *e);
+extern void free_xlate(struct emu *e);
+extern char *get_strcap(struct emu *e, char *cap);
+extern char *tgoto_cm(char *fmt, unsigned row, unsigned col);
+
+/* append decimal n to d, return end */
+static inline char *put_dec(char *d, unsigned n)
+{
+	static const char digits2[] = "00010203040506070809"
+				      "10111213141516171819"
+				      "20212223242526272829"
+				      "30313233343536373839"
+				      "40414243444546474849"
+				      "50515253545556575859"
+				      "60616263646566676869"
+				      "70717273747576777879"
+				      "80818283848586878889"
+				      "90919293949596979899";
+	char tmp[10], *t = tmp + sizeof tmp;
+
+	for ( ; n >= 100; n /= 100) {
+		t -= 2;
+		memcpy(t, digits2 + 2*(n % 100), 2);
+	}
+	if (n >= 10) {
+		t -= 2;
+		memcpy(t, digits2 + 2*n, 2);
+	} else
+		*--t = '0' + n;
+	memcpy(d, t, tmp + sizeof tmp - t);
+	return d + (tmp + sizeof tmp - t);
+}
+
+#endif /* _XLATE_H */